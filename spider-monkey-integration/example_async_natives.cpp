@@ -0,0 +1,672 @@
+// wrapFunction<T> assumes that T::call is done when it
+// returns.  That's fine for toNumber, less fine for a
+// native that reads a file or talks to a local store:
+// while it waits, the whole context waits with it, and a
+// script that wants ten files waits for them one at a time.
+//
+// What we'd like is for such a native to start its I/O,
+// hand the script a promise straight away, and resolve that
+// promise later, so that a script can have many requests in
+// flight at once:
+//
+//     var a = readFile("a.json"), b = readFile("b.json");
+//     a.then(function(s) { ... });
+//
+// The engine version we embed predates built in promises,
+// so the scope installs a small one as part of its prelude
+// (below).  The rest is ours:
+//
+// - wrapAsyncFunction<T> makes the promise, and hands
+//   T::call a completion handle instead of expecting a
+//   result.
+// - T::call starts its work and returns.  Whenever the
+//   work is done, on whatever thread it ran, it completes
+//   the handle.
+// - The scope owns an event loop.  Completions are queued
+//   to it, and it delivers them on the scope's thread,
+//   where it's safe to make JS values and settle promises.
+//
+// Async natives look like this:
+//
+//     struct ReadFile {
+//         static const char* name() {
+//             return "readFile";
+//         }
+//         static void call(JSContext* cx,
+//                          JS::CallArgs args,
+//                          AsyncCompletion completion);
+//     };
+
+// Turns a completed operation into a JS value.  Runs on the
+// scope's thread, when the event loop delivers the
+// completion.
+using AsyncResultProducer =
+    std::function<void(JSContext*, JS::MutableHandleValue)>;
+
+class EventLoop;
+
+// The handle an async native completes.  Movable, usable
+// from any thread, and completing it more than once is an
+// error.  A handle destroyed without being completed
+// rejects its promise, so a native that loses track of a
+// request can't leave a script waiting forever.
+class AsyncCompletion {
+public:
+    AsyncCompletion(EventLoop* loop, uint64_t id)
+        : _loop(loop), _id(id) {}
+
+    AsyncCompletion(AsyncCompletion&& other)
+        : _loop(other._loop), _id(other._id) {
+        other._loop = nullptr;
+    }
+
+    AsyncCompletion(const AsyncCompletion&) = delete;
+    AsyncCompletion& operator=(const AsyncCompletion&) = delete;
+
+    ~AsyncCompletion() {
+        if (_loop) {
+            reject(std::make_exception_ptr(std::runtime_error(
+                "async operation abandoned")));
+        }
+    }
+
+    void resolve(AsyncResultProducer produce);
+    void reject(std::exception_ptr error);
+
+private:
+    EventLoop* _loop;
+    uint64_t _id;
+};
+
+// One per scope.  The only part of it that other threads
+// touch is the completion queue.
+class EventLoop {
+public:
+    explicit EventLoop(JSContext* cx)
+        : _context(cx),
+          _global(cx),
+          _makeDeferred(cx),
+          _drainJobs(cx) {}
+
+    // Capture the prelude's helpers.  Called once, right
+    // after the prelude runs and before any user script
+    // can replace the globals they're installed as.
+    void install(JS::HandleObject global);
+
+    // Make a new promise, returned in promise, and the
+    // handle that settles it
+    AsyncCompletion start(JS::MutableHandleValue promise);
+
+    // Deliver whatever has completed, then run promise
+    // reactions until there are none left.  Doesn't wait.
+    // Enters the scope's global, so callers needn't.
+    void pump();
+
+    // pump() until nothing is pending, waiting for I/O as
+    // needed.  The REPL calls this after every evaluation.
+    void run();
+
+    // pump() until done() is true, waiting for completions or
+    // a wake() in between.  For code on the scope's thread
+    // that waits on other threads without a promise of its
+    // own, like an off thread compile.
+    template <typename Pred>
+    void runUntil(Pred done);
+
+    // Make a waiting runUntil check its predicate again.
+    // Called from any thread.
+    void wake();
+
+    size_t pending() const {
+        return _deferreds.size();
+    }
+
+private:
+    friend class AsyncCompletion;
+
+    struct Completion {
+        uint64_t id;
+        AsyncResultProducer produce;
+        std::exception_ptr error;
+    };
+
+    // Called from any thread
+    void post(Completion completion);
+
+    void settle(Completion& completion);
+    void drainJobs();
+
+    JSContext* _context;
+    JS::PersistentRootedObject _global;
+    JS::PersistentRootedFunction _makeDeferred;
+    JS::PersistentRootedFunction _drainJobs;
+    uint64_t _nextId = 0;
+
+    // Scope thread only.  PersistentRooted can't move, hence
+    // the unique_ptr.
+    std::unordered_map<
+        uint64_t,
+        std::unique_ptr<JS::PersistentRootedObject>>
+        _deferreds;
+
+    std::mutex _mutex;
+    std::condition_variable _completed;
+    std::vector<Completion> _queue;
+    bool _woken = false;
+};
+
+void AsyncCompletion::resolve(AsyncResultProducer produce) {
+    if (!_loop)
+        throw std::logic_error("completed twice");
+
+    auto loop = std::exchange(_loop, nullptr);
+    loop->post({_id, std::move(produce), nullptr});
+}
+
+void AsyncCompletion::reject(std::exception_ptr error) {
+    if (!_loop)
+        throw std::logic_error("completed twice");
+
+    auto loop = std::exchange(_loop, nullptr);
+    loop->post({_id, nullptr, std::move(error)});
+}
+
+void EventLoop::install(JS::HandleObject global) {
+    JSAutoRequest ar(_context);
+    JSAutoCompartment ac(_context, global);
+
+    auto capture = [&](const char* name,
+                       JS::PersistentRootedFunction& out) {
+        JS::RootedValue value(_context);
+        if (!JS_GetProperty(_context, global, name, &value))
+            throwCurrentJSException(_context, name);
+
+        out = JS_ValueToFunction(_context, value);
+        if (!out)
+            throwCurrentJSException(_context, name);
+    };
+
+    _global = global;
+    capture("__deferred", _makeDeferred);
+    capture("__drainJobs", _drainJobs);
+}
+
+AsyncCompletion EventLoop::start(JS::MutableHandleValue promise) {
+    JS::RootedValue deferred(_context);
+    if (!JS_CallFunction(_context,
+                         JS::NullPtr(),
+                         _makeDeferred,
+                         JS::HandleValueArray::empty(),
+                         &deferred)) {
+        throwCurrentJSException(_context,
+                                "failed to make a promise");
+    }
+
+    if (!deferred.isObject())
+        throw std::runtime_error("__deferred returned a non object");
+
+    JS::RootedObject deferredObj(_context, &deferred.toObject());
+    if (!JS_GetProperty(_context, deferredObj, "promise", promise))
+        throwCurrentJSException(_context,
+                                "failed to make a promise");
+
+    auto id = _nextId++;
+    _deferreds.emplace(
+        id,
+        std::make_unique<JS::PersistentRootedObject>(
+            _context, deferredObj));
+    return AsyncCompletion(this, id);
+}
+
+void EventLoop::post(Completion completion) {
+    {
+        std::lock_guard<std::mutex> lk(_mutex);
+        _queue.push_back(std::move(completion));
+    }
+    _completed.notify_one();
+}
+
+void EventLoop::settle(Completion& completion) {
+    auto it = _deferreds.find(completion.id);
+    if (it == _deferreds.end())
+        throw std::logic_error("unknown completion");
+
+    JS::RootedObject deferred(_context, *it->second);
+    _deferreds.erase(it);
+
+    JS::RootedValue value(_context);
+    const char* settler = "resolve";
+
+    // Producing the value can fail too, in which case the
+    // promise rejects with that error instead.
+    try {
+        if (completion.error)
+            std::rethrow_exception(completion.error);
+
+        completion.produce(_context, &value);
+    } catch (...) {
+        cppToJSException(_context);
+        if (!JS_GetPendingException(_context, &value))
+            throw std::runtime_error("lost exception");
+        JS_ClearPendingException(_context);
+        settler = "reject";
+    }
+
+    JS::RootedValue ignored(_context);
+    if (!JS_CallFunctionName(_context,
+                             deferred,
+                             settler,
+                             JS::HandleValueArray(value),
+                             &ignored)) {
+        throwCurrentJSException(_context, "settle failed");
+    }
+}
+
+void EventLoop::drainJobs() {
+    JS::RootedValue ignored(_context);
+
+    if (!JS_CallFunction(_context,
+                         JS::NullPtr(),
+                         _drainJobs,
+                         JS::HandleValueArray::empty(),
+                         &ignored)) {
+        throwCurrentJSException(_context,
+                                "promise reaction failed");
+    }
+}
+
+// Every completion taken off the queue gets settled, even
+// if an earlier one fails: one that was dropped would leave
+// its promise pending, and run() waiting on it forever.
+// The first failure is rethrown once they're all done.
+void EventLoop::pump() {
+    JSAutoRequest ar(_context);
+    JSAutoCompartment ac(_context, _global);
+
+    std::vector<Completion> ready;
+    {
+        std::lock_guard<std::mutex> lk(_mutex);
+        ready.swap(_queue);
+    }
+
+    std::exception_ptr failure;
+    auto attempt = [&](auto&& fn) {
+        try {
+            fn();
+        } catch (...) {
+            if (!failure)
+                failure = std::current_exception();
+        }
+    };
+
+    for (auto& completion : ready)
+        attempt([&] { settle(completion); });
+
+    attempt([&] { drainJobs(); });
+
+    if (failure)
+        std::rethrow_exception(failure);
+}
+
+void EventLoop::run() {
+    pump();
+
+    while (pending()) {
+        {
+            std::unique_lock<std::mutex> lk(_mutex);
+            _completed.wait(lk, [&] { return !_queue.empty(); });
+        }
+        pump();
+    }
+}
+
+void EventLoop::wake() {
+    {
+        std::lock_guard<std::mutex> lk(_mutex);
+        _woken = true;
+    }
+    _completed.notify_one();
+}
+
+template <typename Pred>
+void EventLoop::runUntil(Pred done) {
+    pump();
+
+    while (!done()) {
+        {
+            std::unique_lock<std::mutex> lk(_mutex);
+            _completed.wait(lk, [&] {
+                return !_queue.empty() || _woken;
+            });
+            _woken = false;
+        }
+        pump();
+    }
+}
+
+// The wrapper itself.  Same exception handling as
+// wrapFunction: anything T::call throws while starting the
+// operation becomes a JS exception right away, and no
+// promise is returned.  Failures after that reject the
+// promise.
+template <typename T>
+bool wrapAsyncFunction(JSContext* cx,
+                       unsigned argc,
+                       JS::Value* vp) {
+    try {
+        JS::CallArgs args = JS::CallArgsFromVp(argc, vp);
+        auto& scope = ImplScope::fromContext(cx);
+
+        JS::RootedValue promise(cx);
+        auto completion = scope.getEventLoop().start(&promise);
+
+        T::call(cx, args, std::move(completion));
+
+        args.rval().set(promise);
+        return true;
+    } catch (...) {
+        cppToJSException(cx);
+        return false;
+    }
+}
+
+// The prelude's promise.  Just enough of the usual
+// semantics for natives and scripts to chain on: settle
+// once, adopt thenables, run reactions asynchronously (from
+// the job queue the event loop drains) and in order.  It's
+// only installed if the engine doesn't already provide
+// Promise.
+//
+// The event loop captures __deferred and __drainJobs right
+// after this runs, and __deferred closes over the Promise
+// it was installed with, so scripts that later replace any
+// of those globals only affect themselves.
+const char* const kPromisePrelude = R"js(
+(function(global) {
+    var jobs = [];
+    var create = Object.create;
+
+    global.__drainJobs = function() {
+        while (jobs.length) {
+            var batch = jobs;
+            jobs = [];
+            for (var i = 0; i < batch.length; i++)
+                batch[i]();
+        }
+    };
+
+    var Promise = global.Promise;
+    if (typeof Promise != 'function')
+        Promise = global.Promise = makePromise();
+
+    global.__deferred = function() {
+        var d = create(null);
+        d.promise = new Promise(function(resolve, reject) {
+            d.resolve = resolve;
+            d.reject = reject;
+        });
+        return d;
+    };
+
+    function makePromise() {
+        function Promise(executor) {
+            var self = this;
+            // Set by the first resolve or reject.  Once a
+            // promise has adopted a thenable only that
+            // thenable can settle it.
+            var locked = false;
+            this._state = 0;
+            this._reactions = [];
+
+            function fulfil(state, value) {
+                self._state = state;
+                self._value = value;
+                self._reactions.forEach(function(react) {
+                    jobs.push(function() { react(state, value); });
+                });
+                self._reactions = null;
+            }
+
+            function adopt(state, value) {
+                if (state != 1 || !value ||
+                    typeof value.then != 'function')
+                    return fulfil(state, value);
+
+                var called = false;
+                function once(state) {
+                    return function(v) {
+                        if (called) return;
+                        called = true;
+                        adopt(state, v);
+                    };
+                }
+                try {
+                    value.then(once(1), once(2));
+                } catch (e) {
+                    once(2)(e);
+                }
+            }
+
+            function settle(state, value) {
+                if (locked) return;
+                locked = true;
+                adopt(state, value);
+            }
+
+            try {
+                executor(function(v) { settle(1, v); },
+                         function(e) { settle(2, e); });
+            } catch (e) {
+                settle(2, e);
+            }
+        }
+
+        Promise.prototype.then = function(onFulfilled, onRejected) {
+            var self = this;
+            return new Promise(function(resolve, reject) {
+                function react(state, value) {
+                    var handler =
+                        state == 1 ? onFulfilled : onRejected;
+                    if (typeof handler != 'function')
+                        return (state == 1 ? resolve : reject)(value);
+                    try {
+                        resolve(handler(value));
+                    } catch (e) {
+                        reject(e);
+                    }
+                }
+                if (self._state) {
+                    jobs.push(function() {
+                        react(self._state, self._value);
+                    });
+                } else {
+                    self._reactions.push(react);
+                }
+            });
+        };
+
+        Promise.prototype['catch'] = function(onRejected) {
+            return this.then(undefined, onRejected);
+        };
+
+        return Promise;
+    }
+})(this);
+)js";
+
+// A stand-in for a local store: key value pairs backed by
+// files in a directory, read on a small pool of I/O threads
+// so that requests genuinely overlap.
+class FileStore {
+public:
+    FileStore(std::string root, size_t threads);
+    ~FileStore();
+
+    // Read root/key on an I/O thread, then call done with
+    // the contents or an exception.  Keys are relative paths
+    // that stay inside root: absolute keys and keys with a
+    // ".." segment throw.
+    void read(std::string key,
+              std::function<void(std::string,
+                                 std::exception_ptr)> done);
+
+private:
+    std::string _root;
+    std::vector<std::thread> _threads;
+    std::mutex _mutex;
+    std::condition_variable _ready;
+    std::deque<std::function<void()>> _work;
+    bool _shutdown = false;
+};
+
+FileStore::FileStore(std::string root, size_t threads)
+    : _root(std::move(root)) {
+    for (size_t i = 0; i < threads; i++) {
+        _threads.emplace_back([this] {
+            for (;;) {
+                std::function<void()> work;
+                {
+                    std::unique_lock<std::mutex> lk(_mutex);
+                    _ready.wait(lk, [&] {
+                        return _shutdown || !_work.empty();
+                    });
+                    if (_work.empty())
+                        return;
+                    work = std::move(_work.front());
+                    _work.pop_front();
+                }
+                work();
+            }
+        });
+    }
+}
+
+FileStore::~FileStore() {
+    {
+        std::lock_guard<std::mutex> lk(_mutex);
+        _shutdown = true;
+    }
+    _ready.notify_all();
+
+    for (auto& thread : _threads)
+        thread.join();
+}
+
+void FileStore::read(
+    std::string key,
+    std::function<void(std::string, std::exception_ptr)> done) {
+    if (key.empty() || key.front() == '/')
+        throw std::invalid_argument("bad key: " + key);
+
+    for (size_t begin = 0; begin <= key.size();) {
+        auto end = std::min(key.find('/', begin), key.size());
+        if (key.compare(begin, end - begin, "..") == 0)
+            throw std::invalid_argument("bad key: " + key);
+        begin = end + 1;
+    }
+
+    auto path = _root + "/" + key;
+
+    {
+        std::lock_guard<std::mutex> lk(_mutex);
+        _work.push_back([path, done] {
+            std::ifstream in(path, std::ios::binary);
+            if (!in) {
+                done({},
+                     std::make_exception_ptr(std::runtime_error(
+                         "no such key: " + path)));
+                return;
+            }
+
+            std::ostringstream contents;
+            contents << in.rdbuf();
+            done(contents.str(), nullptr);
+        });
+    }
+    _ready.notify_one();
+}
+
+// And the native that exposes it.  The completion handle is
+// moved into the I/O callback, so it's completed on the I/O
+// thread; only the producer, which makes the JS string,
+// waits for the scope's thread.
+struct ReadFile {
+    static const char* name() {
+        return "readFile";
+    }
+
+    static void call(JSContext* cx,
+                     JS::CallArgs args,
+                     AsyncCompletion completion) {
+        if (!args.get(0).isString())
+            throw std::runtime_error(
+                "readFile takes a key string");
+
+        JSAutoByteString key(cx, args.get(0).toString());
+        if (!key)
+            throw std::runtime_error("failed to convert key");
+
+        auto handle = std::make_shared<AsyncCompletion>(
+            std::move(completion));
+
+        ImplScope::fromContext(cx).getFileStore().read(
+            key.ptr(),
+            [handle](std::string contents,
+                     std::exception_ptr error) {
+                if (error) {
+                    handle->reject(error);
+                    return;
+                }
+
+                handle->resolve(
+                    [contents = std::move(contents)](
+                        JSContext* cx,
+                        JS::MutableHandleValue out) {
+                        JS::RootedString str(
+                            cx,
+                            JS_NewStringCopyN(cx,
+                                              contents.data(),
+                                              contents.size()));
+                        if (!str)
+                            throw std::runtime_error(
+                                "failed to allocate");
+                        out.setString(str);
+                    });
+            });
+    }
+};
+
+// Installed like any other free function:
+//
+//     JS_FN("readFile", wrapAsyncFunction<ReadFile>, 1, 0)
+//
+// To see the overlap, point a FileStore with 8 I/O threads
+// at a directory of files and read 64 of them at once.  The
+// event loop should finish in roughly 64 / 8 file reads'
+// worth of time rather than 64.
+const char* const kConcurrentReads = R"js(
+var sizes = [];
+for (var i = 0; i < 64; i++) {
+    readFile("doc" + i + ".json").then(function(s) {
+        sizes.push(s.length);
+    }, function(e) {
+        print("read failed: " + e);
+    });
+}
+)js";
+
+void exampleConcurrentReads(ImplScope& scope) {
+    using namespace std::chrono;
+
+    auto start = steady_clock::now();
+
+    scope.exec(kConcurrentReads);
+    scope.getEventLoop().run();
+
+    std::cout
+        << "64 reads in "
+        << duration_cast<milliseconds>(
+               steady_clock::now() - start)
+               .count()
+        << " ms\n";
+}
@@ -0,0 +1,119 @@
+// With GC telemetry in place (see example_gc_telemetry.cpp)
+// the first thing it told us was that a script churning
+// through millions of MyType values spends a surprising
+// share of every pause in sweeping, and most of that in
+// AdaptedMyTypeInfo::finalize calling delete once per dead
+// object.
+//
+// SpiderMonkey already knows how to sweep on a helper
+// thread.  Objects whose class has no finalizer are swept
+// in the background for free, and a class can opt in to the
+// same treatment with JSCLASS_BACKGROUND_FINALIZE, as long
+// as its finalizer is safe to run off the main thread.
+// "Safe" is a strong word here: no engine calls, no
+// touching the scope, no allocation that could be observed
+// by the script.  Freeing a heap allocated POD is about the
+// only thing that qualifies, but that's exactly what most
+// of our wrapped types do.
+//
+// Rather than asking every policy author to remember the
+// right flag, it's a policy knob on BaseInfo:
+//
+//     static const bool finalizeInBackground = false;
+//
+// and WrapType folds it into the JSClass flags.
+
+template <typename T>
+constexpr unsigned wrapTypeClassFlags() {
+    return T::classFlags |
+        (T::finalizeInBackground ? JSCLASS_BACKGROUND_FINALIZE
+                                 : 0);
+}
+
+// A type that asks for background finalization without
+// providing a finalizer is almost certainly confused, so we
+// catch that at compile time.  As with the rest of WrapType
+// we reflect on the policy by comparing member pointers
+// against BaseInfo.  WrapType<T> instantiates this, so the
+// check runs for every type we install.
+template <typename T>
+struct CheckFinalizePolicy {
+    static_assert(!T::finalizeInBackground ||
+                      &T::finalize != &BaseInfo::finalize,
+                  "finalizeInBackground requires a finalizer");
+};
+
+// For MyType the policy holds up its end of the bargain by
+// construction: the private is a trivially destructible
+// struct, and the finalizer does nothing else.
+static_assert(std::is_trivially_destructible<MyType>::value,
+              "MyType must stay trivially destructible to be "
+              "finalized in the background");
+
+void AdaptedMyTypeInfo::finalize(JSFreeOp* fop,
+                                 JSObject* obj) {
+    // JS_GetPrivate only reads a slot of an object that is
+    // already dead, so it's fine from any thread.
+    delete static_cast<MyType*>(JS_GetPrivate(obj));
+}
+
+// Two things from earlier posts have to cope with
+// finalizers moving off thread:
+//
+// 1. The countingFinalize trampoline bumps the per type
+//    finalize counter, which is now a relaxed atomic.  It
+//    reaches the scope through the JSFreeOp's runtime,
+//    which is valid on the background thread too; it just
+//    must not do anything with it beyond finding the
+//    WrapType.
+// 2. Boundary tracing records into per thread rings, so
+//    background finalize events simply show up on their
+//    own track in the trace.
+//
+// To see what we actually saved, run a churn script with
+// finalizeInBackground on and off and compare the
+// telemetry.  The script churns AdaptedMyType: the global
+// MyType is the slot backed one, which has no finalizer
+// and so wouldn't exercise any of this.  Sweep time is measured between the finalize
+// callback's group start and end, i.e. inside the pause, so
+// it's exactly the number that should drop.
+const char* const kChurnScript =
+    "for (var i = 0; i < 10 * 1000 * 1000; i++) {\n"
+    "    new AdaptedMyType(String(i));\n"
+    "}\n"
+    "gc();\n";
+
+void benchmarkChurn(ImplScope& scope) {
+    using namespace std::chrono;
+
+    auto before = scope.getGCReport();
+    auto start = steady_clock::now();
+
+    scope.exec(kChurnScript);
+
+    auto elapsed = steady_clock::now() - start;
+    auto after = scope.getGCReport();
+
+    auto millis = [](uint64_t nanos) { return nanos / 1e6; };
+
+    std::cout
+        << "wall:        "
+        << duration_cast<milliseconds>(elapsed).count()
+        << " ms\n"
+        << "collections: "
+        << after.gc.collections - before.gc.collections
+        << "\n"
+        << "total pause: "
+        << millis(after.gc.totalPauseNanos -
+                  before.gc.totalPauseNanos)
+        << " ms\n"
+        << "max pause:   " << millis(after.gc.maxPauseNanos)
+        << " ms\n"
+        << "sweep:       "
+        << millis(after.gc.sweepNanos - before.gc.sweepNanos)
+        << " ms\n"
+        << "finalized:   "
+        << after.finalized[AdaptedMyTypeInfo::className] -
+            before.finalized[AdaptedMyTypeInfo::className]
+        << "\n";
+}
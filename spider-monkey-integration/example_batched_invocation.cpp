@@ -0,0 +1,222 @@
+// The other half of the per document cost is the call
+// itself.  mapReduce map functions and $where predicates
+// are called once per document from C++, and every
+// JS_CallFunction pays the full cost of entering the
+// engine: argument setup, the interpreter or JIT entry
+// frame, and the trip back out.
+//
+// Now that documents arrive as arrays (see
+// example_batch_marshalling.cpp), the loop over them can
+// move into JavaScript.  A tiny trampoline takes the user's
+// function and a batch of documents, calls the function on
+// each one from inside JS, where calls are cheap and
+// inlinable, and returns the results as an array.  We cross
+// into the engine once per batch instead of once per
+// document.
+//
+// Error handling has to stay the same as the per document
+// path.  There, the first document to throw stops the loop
+// and its exception is rethrown as a C++ exception (via
+// throwCurrentJSException, the inverse of the
+// cppToJSException lippincott that wrapFunction uses), with
+// earlier documents' side effects already applied.  The
+// trampoline gets the same behaviour by not catching
+// anything.  The one thing it adds is recording how far it
+// got, so that the C++ error can say which document failed.
+
+// Takes the exception pending on cx, clears it, and throws
+// it as a C++ exception prefixed with context.
+void throwCurrentJSException(JSContext* cx,
+                             const std::string& context);
+
+// The trampoline is made once per scope, when the scope is
+// set up, and kept in a persistent root.  There's no catch:
+// the user's exception propagates untouched, stack and all.
+//
+// Two details keep it honest:
+//
+// - Function.prototype.call and the global Array are
+//   script writable, so the trampoline captures its own
+//   copies while the builtins are still pristine rather
+//   than looking them up per call.
+// - The count is updated before each call rather than in a
+//   finally, which an uncatchable termination (a deadline,
+//   see example_script_deadlines.cpp) would skip.
+const char* const kBatchTrampolineFactory =
+    "(function() {\n"
+    "    var call = Function.prototype.call.bind(\n"
+    "        Function.prototype.call);\n"
+    "    var ArrayCtor = Array;\n"
+    "    return function(fn, docs, state) {\n"
+    "        var out = new ArrayCtor(docs.length);\n"
+    "        for (var i = 0; i < docs.length; i++) {\n"
+    "            state.completed = i;\n"
+    "            out[i] = call(fn, docs[i]);\n"
+    "        }\n"
+    "        state.completed = docs.length;\n"
+    "        return out;\n"
+    "    };\n"
+    "})";
+
+void ImplScope::installBatchTrampoline() {
+    JSAutoRequest ar(_context);
+    JSAutoCompartment ac(_context, _global);
+
+    JS::RootedFunction factory(_context);
+    compileFunction(kBatchTrampolineFactory, &factory);
+
+    JS::RootedValue trampoline(_context);
+    if (!JS_CallFunction(_context,
+                         JS::NullPtr(),
+                         factory,
+                         JS::HandleValueArray::empty(),
+                         &trampoline)) {
+        throwCurrentJSException(
+            _context, "failed to install batch trampoline");
+    }
+
+    _batchTrampoline =
+        JS_ValueToFunction(_context, trampoline);
+    if (!_batchTrampoline)
+        throw std::runtime_error(
+            "batch trampoline isn't a function");
+}
+
+void ImplScope::invokeBatch(JS::HandleFunction fn,
+                            JS::HandleObject docs,
+                            JS::MutableHandleObject results) {
+    JSAutoRequest ar(_context);
+    JSAutoCompartment ac(_context, _global);
+
+    // Defined up front, so that the trampoline's writes
+    // never reach a setter on Object.prototype
+    JS::RootedObject state(_context,
+                           JS_NewPlainObject(_context));
+    if (!state ||
+        !JS_DefineProperty(_context,
+                           state,
+                           "completed",
+                           int32_t(0),
+                           JSPROP_ENUMERATE)) {
+        throw std::runtime_error("failed to allocate");
+    }
+
+    JS::AutoValueArray<3> args(_context);
+    args[0].setObject(*JS_GetFunctionObject(fn));
+    args[1].setObject(*docs);
+    args[2].setObject(*state);
+
+    JS::RootedValue rval(_context);
+
+    if (!JS_CallFunction(_context,
+                         JS::NullPtr(),
+                         _batchTrampoline,
+                         args,
+                         &rval)) {
+        JS::RootedValue completed(_context);
+
+        // Reading a property off our own plain object can't
+        // run script, but it mustn't clobber the pending
+        // exception either, so save it around the read.
+        {
+            JS::AutoSaveExceptionState saved(_context);
+            JS_GetProperty(
+                _context, state, "completed", &completed);
+        }
+
+        throwCurrentJSException(
+            _context,
+            "batch failed at document " +
+                std::to_string(
+                    completed.isNumber()
+                        ? static_cast<uint32_t>(
+                              completed.toNumber())
+                        : 0));
+    }
+
+    results.set(&rval.toObject());
+}
+
+// To compare, here's the per document path the trampoline
+// replaces, and a benchmark that runs the same map function
+// over the same documents both ways.
+void invokePerDocument(ImplScope& scope,
+                       JS::HandleFunction fn,
+                       JS::HandleObject docs,
+                       JS::MutableHandleObject results) {
+    JSContext* cx = scope.getContext();
+    JSAutoRequest ar(cx);
+    JSAutoCompartment ac(cx, scope.getGlobal());
+
+    uint32_t length;
+    if (!JS_GetArrayLength(cx, docs, &length))
+        throw std::runtime_error("failed to get length");
+
+    JS::AutoValueVector out(cx);
+    if (!out.reserve(length))
+        throw std::runtime_error("failed to allocate");
+
+    JS::RootedValue doc(cx);
+    JS::RootedObject thisv(cx);
+    JS::RootedValue rval(cx);
+
+    for (uint32_t i = 0; i < length; i++) {
+        if (!JS_GetElement(cx, docs, i, &doc))
+            throw std::runtime_error("failed to get doc");
+
+        thisv = &doc.toObject();
+
+        if (!JS_CallFunction(cx,
+                             thisv,
+                             fn,
+                             JS::HandleValueArray::empty(),
+                             &rval)) {
+            throwCurrentJSException(
+                cx,
+                "batch failed at document " +
+                    std::to_string(i));
+        }
+
+        out.infallibleAppend(rval);
+    }
+
+    results.set(JS_NewArrayObject(cx, out));
+    if (!results)
+        throw std::runtime_error("failed to allocate");
+}
+
+const char* const kMapFunction =
+    "function() { emit(this.key, this.value); }";
+
+void benchmarkBatchedInvocation(
+    ImplScope& scope,
+    const std::vector<BSONObj>& docs,
+    SharedBuffer* buffer) {
+    using namespace std::chrono;
+
+    JSContext* cx = scope.getContext();
+    JS::RootedFunction map(cx);
+    scope.compileFunction(kMapFunction, &map);
+
+    JS::RootedObject array(cx);
+    JS::RootedObject results(cx);
+    scope.newArrayFromBatch(docs, buffer, &array);
+
+    auto time = [&](const char* label, auto&& invoke) {
+        auto start = steady_clock::now();
+        invoke();
+        auto elapsed = steady_clock::now() - start;
+
+        std::cout
+            << label << ": "
+            << duration_cast<milliseconds>(elapsed).count()
+            << " ms for " << docs.size() << " documents\n";
+    };
+
+    time("per document", [&] {
+        invokePerDocument(scope, map, array, &results);
+    });
+    time("batched     ", [&] {
+        scope.invokeBatch(map, array, &results);
+    });
+}
@@ -0,0 +1,333 @@
+// This picks up where example_type_embedding.cpp left off.
+// We have wrapFunction, wrapConstrainedMethod and WrapType
+// stamping out all of our callbacks, and life is good right
+// up until somebody hands us a mapReduce job that takes ten
+// minutes and asks where the time went.
+//
+// A profiler will happily tell you that time is being
+// spent "in the JIT" or "in libmozjs", but what we actually
+// want to know is how the wall clock splits between
+// JavaScript and our natives.  Conveniently, every single
+// crossing from JavaScript into our code goes through one
+// of a handful of templates, so that's where we'll hang our
+// instrumentation.
+//
+// The output format we'll target is Chrome's trace_event
+// JSON, which can be loaded directly into chrome://tracing
+// or Perfetto.  It's just a list of begin and end events,
+// each tagged with a name, a timestamp and a thread id.
+
+// A single begin or end event.  Names are always string
+// literals (T::name() or a className), so we only store
+// the pointer.
+struct TraceEvent {
+    const char* name;
+    const char* category;
+    uint64_t ts;  // nanoseconds, steady clock
+    char phase;   // 'B'egin or 'E'nd
+};
+
+// Every thread that crosses into native code gets its own
+// ring of events.  The owning thread is the only writer and
+// the flushing thread is the only reader, so a pair of
+// monotonically increasing counters is all the
+// synchronization we need.  When the ring is full we drop
+// events and count them rather than block the caller.
+class TraceRing {
+public:
+    static constexpr size_t kCapacity = 1 << 16;
+
+    explicit TraceRing(uint32_t tid) : _tid(tid) {}
+
+    void push(const TraceEvent& event) {
+        auto head = _head.load(std::memory_order_relaxed);
+        auto tail = _tail.load(std::memory_order_acquire);
+
+        if (head - tail == kCapacity) {
+            _dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        _events[head & (kCapacity - 1)] = event;
+        _head.store(head + 1, std::memory_order_release);
+    }
+
+    template <typename Callback>
+    void drain(Callback&& callback) {
+        auto tail = _tail.load(std::memory_order_relaxed);
+        auto head = _head.load(std::memory_order_acquire);
+
+        for (; tail != head; ++tail) {
+            callback(_events[tail & (kCapacity - 1)]);
+        }
+
+        _tail.store(tail, std::memory_order_release);
+    }
+
+    uint32_t tid() const {
+        return _tid;
+    }
+
+    uint64_t dropped() const {
+        return _dropped.load(std::memory_order_relaxed);
+    }
+
+private:
+    const uint32_t _tid;
+    std::atomic<uint64_t> _head{0};
+    std::atomic<uint64_t> _tail{0};
+    std::atomic<uint64_t> _dropped{0};
+    std::array<TraceEvent, kCapacity> _events;
+};
+
+// The tracer itself is process wide.  Rings are handed out
+// lazily, the first time a thread records an event, and are
+// owned by the tracer so that flushing still works after
+// the thread that filled one has exited.
+class BoundaryTracer {
+public:
+    // This is the only thing the untraced path ever looks
+    // at.  A relaxed load of a flag that almost never
+    // changes is about as predictable as a branch gets.
+    static bool enabled() {
+        return _enabled.load(std::memory_order_relaxed);
+    }
+
+    static void setEnabled(bool enabled) {
+        _enabled.store(enabled, std::memory_order_relaxed);
+    }
+
+    static void record(const char* name,
+                       const char* category,
+                       char phase) {
+        auto ts = std::chrono::duration_cast<
+                      std::chrono::nanoseconds>(
+                      std::chrono::steady_clock::now()
+                          .time_since_epoch())
+                      .count();
+
+        threadRing().push(TraceEvent{
+            name, category, static_cast<uint64_t>(ts), phase});
+    }
+
+    // Write everything recorded so far as a trace_event
+    // JSON document.  Safe to call while other threads are
+    // still recording; their newer events will simply show
+    // up in the next flush.
+    static void flush(std::ostream& out);
+
+private:
+    static TraceRing& threadRing() {
+        thread_local TraceRing* ring = nullptr;
+
+        if (!ring) {
+            std::lock_guard<std::mutex> lk(_ringsMutex);
+            _rings.push_back(std::make_unique<TraceRing>(
+                static_cast<uint32_t>(_rings.size() + 1)));
+            ring = _rings.back().get();
+        }
+
+        return *ring;
+    }
+
+    static std::atomic<bool> _enabled;
+    static std::mutex _ringsMutex;
+    static std::vector<std::unique_ptr<TraceRing>> _rings;
+};
+
+std::atomic<bool> BoundaryTracer::_enabled{false};
+std::mutex BoundaryTracer::_ringsMutex;
+std::vector<std::unique_ptr<TraceRing>>
+    BoundaryTracer::_rings;
+
+void BoundaryTracer::flush(std::ostream& out) {
+    std::lock_guard<std::mutex> lk(_ringsMutex);
+
+    const auto pid = static_cast<long>(getpid());
+    bool first = true;
+
+    out << "{\"traceEvents\":[";
+
+    for (auto& ring : _rings) {
+        ring->drain([&](const TraceEvent& event) {
+            if (!first)
+                out << ",\n";
+            first = false;
+
+            // Names are C++ identifiers, so they never need
+            // JSON escaping.  Chrome wants microseconds.
+            out << "{\"name\":\"" << event.name
+                << "\",\"cat\":\"" << event.category
+                << "\",\"ph\":\"" << event.phase
+                << "\",\"ts\":" << event.ts / 1000 << '.'
+                << std::setw(3) << std::setfill('0')
+                << event.ts % 1000 << std::setfill(' ')
+                << ",\"pid\":" << pid
+                << ",\"tid\":" << ring->tid() << "}";
+        });
+    }
+
+    out << "],\"displayTimeUnit\":\"ns\"}\n";
+
+    for (auto& ring : _rings) {
+        if (auto dropped = ring->dropped()) {
+            std::cerr << "boundary trace: thread "
+                      << ring->tid() << " dropped "
+                      << dropped << " events\n";
+        }
+    }
+}
+
+// Now for the policies.  As with everything else in this
+// integration we'd rather choose at compile time, so the
+// tracing policy is a template parameter.  NoTrace folds
+// away entirely, while BoundaryTrace costs one load and one
+// well predicted branch per call when tracing is off.
+struct NoTrace {
+    static constexpr bool enabled() {
+        return false;
+    }
+
+    template <typename Callable>
+    static void traced(const char*,
+                       const char*,
+                       Callable&& callable) {
+        callable();
+    }
+};
+
+struct BoundaryTrace {
+    static bool enabled() {
+        return BoundaryTracer::enabled();
+    }
+
+    // Record a begin event, run the callable and record the
+    // matching end event, even if the callable throws.
+    template <typename Callable>
+    static void traced(const char* name,
+                       const char* category,
+                       Callable&& callable) {
+        struct End {
+            const char* name;
+            const char* category;
+            ~End() {
+                BoundaryTracer::record(name, category, 'E');
+            }
+        };
+
+        BoundaryTracer::record(name, category, 'B');
+        End end{name, category};
+        callable();
+    }
+};
+
+// With those in hand, wrapFunction grows one parameter and
+// one branch.  Note that we make the decision once, up
+// front, rather than checking on the way in and again on
+// the way out.
+template <typename T, typename TracePolicy = BoundaryTrace>
+bool wrapFunction(JSContext* cx,
+                  unsigned argc,
+                  JS::Value* vp) {
+    try {
+        JS::CallArgs args = JS::CallArgsFromVp(argc, vp);
+
+        if (MOZ_UNLIKELY(TracePolicy::enabled())) {
+            TracePolicy::traced(T::name(), "native", [&] {
+                T::call(cx, args);
+            });
+        } else {
+            T::call(cx, args);
+        }
+
+        return true;
+    } catch (...) {
+        cppToJSException(cx);
+        return false;
+    }
+}
+
+// wrapConstrainedMethod gets the same treatment.  We trace
+// the type checks as well as the call, since an expensive
+// instanceOf is exactly the sort of thing we'd like to see.
+template <typename T,
+          bool noProto,
+          typename TracePolicy,
+          typename... Args>
+bool wrapTracedConstrainedMethod(JSContext* cx,
+                                 unsigned argc,
+                                 JS::Value* vp) {
+    if (MOZ_UNLIKELY(TracePolicy::enabled())) {
+        bool ok;
+        TracePolicy::traced(T::name(), "method", [&] {
+            ok = wrapConstrainedMethod<T, noProto, Args...>(
+                cx, argc, vp);
+        });
+        return ok;
+    }
+
+    return wrapConstrainedMethod<T, noProto, Args...>(
+        cx, argc, vp);
+}
+
+// The JSClass that WrapType builds doesn't point at our
+// policy functions directly.  It points at small static
+// trampolines which massage exceptions, just like
+// wrapFunction does.  Those trampolines are where the
+// lifecycle hooks get traced, using the className as the
+// event name and the hook as its category.  Here's
+// construct; the others follow the same pattern.
+template <typename T, typename TracePolicy = BoundaryTrace>
+struct WrapTypeHooks {
+    static bool construct(JSContext* cx,
+                          unsigned argc,
+                          JS::Value* vp) {
+        try {
+            JS::CallArgs args = JS::CallArgsFromVp(argc, vp);
+
+            if (MOZ_UNLIKELY(TracePolicy::enabled())) {
+                TracePolicy::traced(
+                    T::className, "construct", [&] {
+                        T::construct(cx, args);
+                    });
+            } else {
+                T::construct(cx, args);
+            }
+
+            return true;
+        } catch (...) {
+            cppToJSException(cx);
+            return false;
+        }
+    }
+
+    // Finalizers run during sweeping, which makes them one
+    // of the more interesting things to see on a timeline.
+    static void finalize(JSFreeOp* fop, JSObject* obj) {
+        if (MOZ_UNLIKELY(TracePolicy::enabled())) {
+            TracePolicy::traced(T::className, "finalize", [&] {
+                T::finalize(fop, obj);
+            });
+        } else {
+            T::finalize(fop, obj);
+        }
+    }
+};
+
+// Types and callbacks that should never show up in a trace
+// (or that are hot enough that we don't even want the
+// branch) can opt out with NoTrace:
+//
+//     wrapFunction<Callback, NoTrace>
+//
+// Collecting a trace from the shell is then just:
+void traceMapReduce(JSContext* cx, JS::HandleObject global) {
+    BoundaryTracer::setEnabled(true);
+
+    // ... run the job ...
+
+    BoundaryTracer::setEnabled(false);
+
+    std::ofstream out("mapreduce.trace.json");
+    BoundaryTracer::flush(out);
+}
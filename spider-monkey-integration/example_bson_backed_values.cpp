@@ -0,0 +1,335 @@
+// Documents come into JavaScript as BSON.  Every NumberLong
+// field in them turns into a MyType, which today means
+// going down the same path as the constructor: allocate a
+// MyType on the heap, copy the 8 bytes in, and attach it as
+// the object's private.  For a large result set that's one
+// malloc (and, later, one free) per numeric field, for a
+// value that was sitting in memory already.
+//
+// BSON buffers are immutable once built, and the shell
+// already holds them in refcounted storage.  So instead of
+// copying, a MyType can simply point into the buffer and
+// hold a reference on it.  toNumber and toString read the 8
+// bytes where they lie, and the buffer goes away when the
+// last wrapper pointing into it is finalized.
+//
+// Assume mongo's BSONObj and BSONElement for walking the
+// document; all we need from them is an element's type and
+// a pointer to its value bytes.
+
+// A refcounted, immutable byte buffer.  The header and the
+// data share a single allocation.  The count is atomic
+// because finalizers may run on the background sweeping
+// thread, and because buffers end up shared between
+// contexts.
+class SharedBuffer {
+public:
+    static SharedBuffer* allocate(size_t size) {
+        void* mem = std::malloc(sizeof(SharedBuffer) + size);
+        if (!mem)
+            throw std::bad_alloc();
+
+        return new (mem) SharedBuffer(size);
+    }
+
+    void retain() {
+        _refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void release() {
+        if (_refs.fetch_sub(1, std::memory_order_acq_rel) ==
+            1) {
+            this->~SharedBuffer();
+            std::free(this);
+        }
+    }
+
+    char* data() {
+        return reinterpret_cast<char*>(this + 1);
+    }
+
+    const char* data() const {
+        return reinterpret_cast<const char*>(this + 1);
+    }
+
+    // The buffer whose data() is data
+    static SharedBuffer* fromData(void* data) {
+        return reinterpret_cast<SharedBuffer*>(data) - 1;
+    }
+
+    size_t size() const {
+        return _size;
+    }
+
+private:
+    explicit SharedBuffer(size_t size) : _refs(1), _size(size) {}
+
+    std::atomic<uint32_t> _refs;
+    const size_t _size;
+};
+
+// BSON is little endian on the wire.  memcpy keeps us clear
+// of alignment trouble; compilers turn it into a single
+// load.
+inline int64_t readInt64LE(const char* bytes) {
+    uint64_t raw;
+    std::memcpy(&raw, bytes, sizeof(raw));
+    return static_cast<int64_t>(le64toh(raw));
+}
+
+// The BSON backed storage mode.  It isn't a separate type
+// as far as scripts are concerned: it's installed privately
+// and inherits from MyType, so instanceof and the MyType
+// prototype behave exactly as before.  Its own prototype
+// only overrides the methods that need to know where the
+// bytes live.
+//
+// The private points at the value bytes inside the buffer,
+// and a reserved slot holds the buffer itself so that the
+// finalizer knows what to release.
+struct BSONMyTypeInfo : public BaseInfo {
+    enum Slots : uint32_t {
+        BufferSlot = 0,
+        SlotCount,
+    };
+
+    static void finalize(JSFreeOp* fop, JSObject* obj);
+
+    struct Functions {
+        DECLARE_JS_FUNCTION(add);
+        DECLARE_JS_FUNCTION(toString);
+        DECLARE_JS_FUNCTION(toNumber);
+    };
+
+    static const JSFunctionSpec methods[4];
+
+    static const char* const className;
+    static const char* const inheritFrom;
+    static const InstallType installType =
+        InstallType::Private;
+    static const unsigned classFlags = JSCLASS_HAS_PRIVATE |
+        JSCLASS_HAS_RESERVED_SLOTS(SlotCount);
+
+    // release() only touches an atomic and free()
+    static const bool finalizeInBackground = true;
+
+    // Clones by sharing the buffer.  See
+    // example_structured_clone.cpp.
+    static const uint32_t cloneTag = kBSONMyTypeCloneTag;
+    static void writeClone(JSContext* cx,
+                           JSStructuredCloneWriter* writer,
+                           JS::HandleObject obj,
+                           CloneBuffer& clone);
+    static void readClone(JSContext* cx,
+                          JSStructuredCloneReader* reader,
+                          CloneBuffer& clone,
+                          JS::MutableHandleValue out);
+
+    // Prints as MyType("123").  See
+    // example_native_printing.cpp.
+    static void print(JSContext* cx,
+                      JS::HandleObject obj,
+                      OutputBuffer& out);
+
+    // One wrapper per value while it's alive.  See
+    // example_weak_identity.cpp.
+    static const bool weakIdentity = true;
+
+    // Make a MyType viewing the 8 bytes at value, which
+    // must lie inside buffer.  Takes a reference on buffer.
+    static void make(JSContext* cx,
+                     SharedBuffer* buffer,
+                     const char* value,
+                     JS::MutableHandleValue out);
+
+    // Always allocate a fresh object
+    static void makeUncached(JSContext* cx,
+                             SharedBuffer* buffer,
+                             const char* value,
+                             JS::MutableHandleObject out);
+
+    static int64_t getValue(JSObject* obj) {
+        return readInt64LE(
+            static_cast<const char*>(JS_GetPrivate(obj)));
+    }
+};
+
+const JSFunctionSpec BSONMyTypeInfo::methods[4] = {
+    ATTACH_JS_CONSTRAINED_METHOD_NO_PROTO(add,
+                                          BSONMyTypeInfo),
+    ATTACH_JS_CONSTRAINED_METHOD_NO_PROTO(toNumber,
+                                          BSONMyTypeInfo),
+    ATTACH_JS_CONSTRAINED_METHOD_NO_PROTO(toString,
+                                          BSONMyTypeInfo),
+    JS_FS_END,
+};
+
+const char* const BSONMyTypeInfo::className = "BSONMyType";
+const char* const BSONMyTypeInfo::inheritFrom = "MyType";
+
+void BSONMyTypeInfo::makeUncached(JSContext* cx,
+                                  SharedBuffer* buffer,
+                                  const char* value,
+                                  JS::MutableHandleObject obj) {
+    ImplScope::fromContext(cx)
+        .getProto<BSONMyTypeInfo>()
+        .newObject(obj);
+
+    if (!obj)
+        throw std::runtime_error("failed to allocate MyType");
+
+    // Nothing can fail past this point, so there's no window
+    // where we hold a reference that the finalizer won't
+    // drop.
+    buffer->retain();
+    JS_SetReservedSlot(
+        obj, BufferSlot, JS::PrivateValue(buffer));
+    JS_SetPrivate(obj, const_cast<char*>(value));
+}
+
+void BSONMyTypeInfo::finalize(JSFreeOp* fop, JSObject* obj) {
+    auto slot = JS_GetReservedSlot(obj, BufferSlot);
+
+    // The prototype, or an object whose make() never got as
+    // far as attaching a buffer
+    if (slot.isUndefined())
+        return;
+
+    static_cast<SharedBuffer*>(slot.toPrivate())->release();
+}
+
+// Natives taking a MyType argument have to accept either
+// flavour, or scripts could tell them apart.  False if obj
+// is neither, or is one of the prototypes.
+bool getMyTypeValue(JSContext* cx,
+                    JS::HandleObject obj,
+                    int64_t* value) {
+    auto& scope = ImplScope::fromContext(cx);
+
+    auto& slotProto = scope.getProto<SlotMyTypeInfo>();
+    if (slotProto.instanceOf(obj) &&
+        obj != slotProto.getProto()) {
+        *value = SlotMyTypeInfo::getValue(obj);
+        return true;
+    }
+
+    auto& bsonProto = scope.getProto<BSONMyTypeInfo>();
+    if (bsonProto.instanceOf(obj) &&
+        obj != bsonProto.getProto()) {
+        *value = BSONMyTypeInfo::getValue(obj);
+        return true;
+    }
+
+    return false;
+}
+
+// add for both flavours, lhs being this's value.  The sum
+// is always a plain MyType.
+void addMyTypes(JSContext* cx, int64_t lhs, JS::CallArgs args) {
+    JS::RootedObject other(
+        cx,
+        args.get(0).isObject() ? &args.get(0).toObject()
+                               : nullptr);
+
+    int64_t rhs;
+    if (!other || !getMyTypeValue(cx, other, &rhs)) {
+        throw std::runtime_error(
+            "MyType.add takes another MyType");
+    }
+
+    int64_t sum;
+    if (__builtin_add_overflow(lhs, rhs, &sum))
+        throw std::overflow_error("MyType.add overflowed");
+
+    SlotMyTypeInfo::make(cx, sum, args.rval());
+}
+
+void BSONMyTypeInfo::Functions::add::call(JSContext* cx,
+                                          JS::CallArgs args) {
+    addMyTypes(cx, getValue(&args.thisv().toObject()), args);
+}
+
+void BSONMyTypeInfo::Functions::toNumber::call(
+    JSContext* cx, JS::CallArgs args) {
+    args.rval().setNumber(static_cast<double>(
+        getValue(&args.thisv().toObject())));
+}
+
+void BSONMyTypeInfo::Functions::toString::call(
+    JSContext* cx, JS::CallArgs args) {
+    auto str =
+        std::to_string(getValue(&args.thisv().toObject()));
+
+    JS::RootedString rstr(cx,
+                          JS_NewStringCopyZ(cx, str.c_str()));
+    if (!rstr)
+        throw std::runtime_error("failed to allocate");
+
+    args.rval().setString(rstr);
+}
+
+// The conversion from BSON to JS then hands NumberLong
+// fields to BSONMyTypeInfo rather than copying them.  All
+// of the other field types are converted as before.
+void bsonToJS(JSContext* cx,
+              SharedBuffer* buffer,
+              const BSONObj& obj,
+              JS::MutableHandleObject out) {
+    out.set(JS_NewPlainObject(cx));
+    if (!out)
+        throw std::runtime_error("failed to allocate");
+
+    JS::RootedValue value(cx);
+
+    for (const auto& elem : obj) {
+        switch (elem.type()) {
+            case NumberLong:
+                BSONMyTypeInfo::make(
+                    cx, buffer, elem.value(), &value);
+                break;
+            default:
+                bsonElementToJS(cx, buffer, elem, &value);
+                break;
+        }
+
+        // Defined rather than set, so that a field named
+        // __proto__ is just a field, and no setter on
+        // Object.prototype runs
+        if (!JS_DefineProperty(cx,
+                               out,
+                               elem.fieldName(),
+                               value,
+                               JSPROP_ENUMERATE)) {
+            throw std::runtime_error(
+                "failed to set field");
+        }
+    }
+}
+
+// To see the difference, convert a million documents with
+// a handful of NumberLong fields each, with and without the
+// BSON backed mode.  The number to watch besides wall time
+// is MyType privates allocated, which should go from one
+// per field to zero.
+void benchmarkConversion(ImplScope& scope,
+                         const std::vector<BSONObj>& docs,
+                         SharedBuffer* buffer) {
+    using namespace std::chrono;
+
+    JSContext* cx = scope.getContext();
+    JSAutoRequest ar(cx);
+    JSAutoCompartment ac(cx, scope.getGlobal());
+
+    JS::RootedObject doc(cx);
+    auto start = steady_clock::now();
+
+    for (const auto& obj : docs) {
+        bsonToJS(cx, buffer, obj, &doc);
+    }
+
+    auto elapsed = steady_clock::now() - start;
+
+    std::cout << docs.size() << " documents in "
+              << duration_cast<milliseconds>(elapsed).count()
+              << " ms\n";
+}
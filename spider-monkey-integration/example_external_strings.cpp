@@ -0,0 +1,167 @@
+// Every native that returns a string copies it: toString
+// builds a std::string and JS_NewStringCopyZ copies that into
+// the engine's heap.  For a short string that's the right
+// thing.  For a 100MB JSON export or a log blob it means two
+// 100MB allocations, one of which we're about to throw away,
+// and a 100MB memcpy between them.
+//
+// SpiderMonkey has external strings for this.  A string made
+// with JS_NewExternalString uses our chars in place, and
+// when it's collected the engine calls a JSStringFinalizer
+// to give them back.  Put the chars in a SharedBuffer (see
+// example_bson_backed_values.cpp) and the string can simply
+// hold a reference to it, like any other owner.
+//
+// Two things to know:
+//
+// - External strings in the engine version we embed are
+//   always UTF-16.  Producers of big strings need to write
+//   char16_t into the buffer to begin with, or the saving is
+//   lost to the inflation.
+// - Each external string costs a finalizer call and can't
+//   live in the nursery, so below a threshold a copy is
+//   cheaper, and newSharedString copies instead.
+
+namespace {
+
+// Strings shorter than this, in chars, are copied
+constexpr size_t kExternalStringThreshold = 16 * 1024;
+
+// The string's chars are the buffer's data, so the
+// finalizer can find the buffer from them
+void finalizeSharedString(const JSStringFinalizer*,
+                          char16_t* chars) {
+    SharedBuffer::fromData(chars)->release();
+}
+
+const JSStringFinalizer kSharedStringFinalizer = {
+    finalizeSharedString};
+
+}  // namespace
+
+// Makes a JS string of buffer's contents, which must be
+// UTF-16.  Large buffers are shared with the string, which
+// takes its own reference; small ones are copied.  Either
+// way the caller keeps its reference.
+void newSharedString(JSContext* cx,
+                     SharedBuffer* buffer,
+                     JS::MutableHandleValue out) {
+    auto chars = reinterpret_cast<char16_t*>(buffer->data());
+    auto length = buffer->size() / sizeof(char16_t);
+
+    JSString* str;
+    if (length < kExternalStringThreshold) {
+        str = JS_NewUCStringCopyN(cx, chars, length);
+    } else {
+        buffer->retain();
+        str = JS_NewExternalString(
+            cx, chars, length, &kSharedStringFinalizer);
+        if (!str) {
+            buffer->release();
+        } else {
+            // The GC doesn't see memory it didn't allocate.
+            // Without this, a loop making big external
+            // strings would run out of memory long before
+            // the heap looked full enough to collect.
+            JS_updateMallocCounter(cx, buffer->size());
+        }
+    }
+
+    if (!str)
+        throwCurrentJSException(cx, "failed to make string");
+
+    out.setString(str);
+}
+
+// A producer writes its output straight into one of these,
+// then hands it to newSharedString.
+SharedBuffer* allocateStringBuffer(size_t length) {
+    return SharedBuffer::allocate(length * sizeof(char16_t));
+}
+
+// Resident set size now, from /proc/self/statm.  Peak RSS
+// (ru_maxrss) is no good for comparing two runs in one
+// process: it only goes up, so whichever mode runs second
+// looks free.
+size_t currentRSS() {
+    std::ifstream statm("/proc/self/statm");
+    size_t pages = 0, resident = 0;
+    statm >> pages >> resident;
+    return resident * ::sysconf(_SC_PAGESIZE);
+}
+
+// Each size both ways: time per string, and how much RSS
+// has grown by the end of the run, before the GC that
+// follows it.  Every string is used from JS (its length
+// read) so neither path can be optimized away, and a GC
+// between runs gives the external buffers back.
+void benchmarkExternalStrings(ImplScope& scope) {
+    using namespace std::chrono;
+
+    JSContext* cx = scope.getContext();
+    JSRuntime* rt = JS_GetRuntime(cx);
+    JSAutoRequest ar(cx);
+    JSAutoCompartment ac(cx, scope.getGlobal());
+
+    JS::RootedValue str(cx);
+    JS::RootedObject global(cx, scope.getGlobal());
+
+    struct Case {
+        const char* label;
+        size_t bytes;
+        size_t iterations;
+    };
+
+    for (auto c : {Case{"1KB  ", 1024, 100000},
+                   Case{"1MB  ", 1024 * 1024, 1000},
+                   Case{"100MB", 100 * 1024 * 1024, 10}}) {
+        auto length = c.bytes / sizeof(char16_t);
+        auto buffer = allocateStringBuffer(length);
+        std::fill_n(reinterpret_cast<char16_t*>(buffer->data()),
+                    length,
+                    u'x');
+
+        auto run = [&](const char* mode, auto&& make) {
+            JS_GC(rt);
+
+            auto before = currentRSS();
+
+            auto start = steady_clock::now();
+            for (size_t i = 0; i < c.iterations; i++) {
+                make();
+                if (!JS_SetProperty(cx, global, "s", str))
+                    throwCurrentJSException(cx, "set failed");
+                scope.exec("s.length");
+            }
+            auto elapsed = steady_clock::now() - start;
+
+            auto after = currentRSS();
+
+            std::cout
+                << c.label << " " << mode << ": "
+                << duration_cast<nanoseconds>(elapsed).count() /
+                    c.iterations
+                << " ns/string, RSS +"
+                << (static_cast<double>(after) - before) /
+                    (1024 * 1024)
+                << " MB\n";
+        };
+
+        run("copy  ", [&] {
+            JSString* s = JS_NewUCStringCopyN(
+                cx,
+                reinterpret_cast<char16_t*>(buffer->data()),
+                length);
+            if (!s)
+                throwCurrentJSException(cx, "copy failed");
+            str.setString(s);
+        });
+
+        run("shared", [&] { newSharedString(cx, buffer, &str); });
+
+        str.setUndefined();
+        JS_DeleteProperty(cx, global, "s");
+        JS_GC(rt);
+        buffer->release();
+    }
+}
@@ -0,0 +1,570 @@
+// Back in example_type_embedding.cpp we waved our hands at
+// fromContext, the function that gets us from a JSContext*
+// to whatever object owns that context's bookkeeping.  In
+// the mongo shell that's the implementation scope: one per
+// runtime, holding the runtime, the context, the global
+// object and one WrapType instance per installed type.
+//
+// When a shell workload stalls, the scope is the obvious
+// place to ask "was that the garbage collector?"  It owns
+// the runtime, so it can register GC callbacks, and it owns
+// every WrapType, so it can tell you which of them are
+// producing the garbage.
+
+// What we keep per collection.  Reasons come from
+// JS::gcreason::ExplainReason, which hands back string
+// literals, so the pointer is enough.
+struct GCRecord {
+    const char* reason;
+    uint64_t totalPauseNanos;
+    uint64_t maxSliceNanos;
+    uint32_t slices;
+};
+
+// Running totals, plus a short history of recent
+// collections so that a slow one can be inspected after the
+// fact.
+struct GCStats {
+    static constexpr size_t kHistory = 64;
+
+    uint64_t collections = 0;
+    uint64_t slices = 0;
+    uint64_t totalPauseNanos = 0;
+    uint64_t maxPauseNanos = 0;
+    uint64_t sweepNanos = 0;
+
+    std::map<std::string, uint64_t> reasons;
+    std::array<GCRecord, kHistory> recent{};
+
+    const GCRecord& last() const {
+        return recent[(collections + kHistory - 1) % kHistory];
+    }
+};
+
+class ImplScope {
+public:
+    // The prelude is installed from the snapshot at
+    // preludeSnapshot if it's usable, and from source if
+    // not.  See example_prelude_snapshot.cpp.
+    explicit ImplScope(
+        JSRuntime* runtime,
+        const std::string& preludeSnapshot = kPreludeSnapshotPath);
+    ~ImplScope();
+
+    // Both the runtime and the context carry a pointer back
+    // to the scope.  The context one is what natives use;
+    // the runtime one is for callbacks, like finalizers and
+    // GC hooks, that only get a runtime (or a JSFreeOp).
+    static ImplScope& fromContext(JSContext* cx) {
+        return *static_cast<ImplScope*>(
+            JS_GetContextPrivate(cx));
+    }
+
+    static ImplScope& fromRuntime(JSRuntime* rt) {
+        return *static_cast<ImplScope*>(
+            JS_GetRuntimePrivate(rt));
+    }
+
+    static ImplScope& fromFreeOp(JSFreeOp* fop) {
+        return fromRuntime(fop->runtime());
+    }
+
+    JSContext* getContext() const {
+        return _context;
+    }
+
+    JS::HandleObject getGlobal() const {
+        return _global;
+    }
+
+    // Whether the constructor installed the prelude from
+    // the snapshot
+    bool preludeFromSnapshot() const {
+        return _preludeFromSnapshot;
+    }
+
+    // Compile and run a script in the global scope,
+    // converting a pending JS exception into a C++ one.
+    // Compiles go through the process wide script cache.
+    // See example_script_cache.cpp.
+    void exec(const std::string& source);
+    void exec(const std::string& source,
+              JS::MutableHandleValue rval);
+
+    // Run the script at path, mapping it rather than reading
+    // it, and letting the engine drop its copy of the source.
+    // See example_mapped_sources.cpp.
+    void execFile(const std::string& path,
+                  JS::MutableHandleValue rval);
+
+    // As above, but stop the script if it runs for longer
+    // than limit, throwing ScriptTimeout.  See
+    // example_script_deadlines.cpp.
+    void exec(const std::string& source,
+              std::chrono::milliseconds limit,
+              JS::MutableHandleValue rval);
+
+    // Throw ScriptTimeout if the current evaluation's
+    // deadline has passed.  Cheap enough for natives to
+    // call from inner loops.
+    void checkDeadline() const;
+
+    // For the watchdog thread
+    void interruptForDeadline();
+
+    // Start compiling a script on one of the engine's helper
+    // threads.  Scripts too small to be worth it compile
+    // right away.  See example_offthread_compile.cpp.
+    PendingScript compileAsync(const std::string& source,
+                               const std::string& filename);
+
+    // Compile source, which must be a function expression,
+    // into a function object.  Also cached.
+    void compileFunction(const std::string& source,
+                         JS::MutableHandleFunction out);
+
+    // Convert a batch of documents, all living in buffer,
+    // into a single JS array.  See
+    // example_batch_marshalling.cpp.
+    void newArrayFromBatch(const std::vector<BSONObj>& batch,
+                           SharedBuffer* buffer,
+                           JS::MutableHandleObject out);
+
+    // Call fn with each element of docs as this, from a JS
+    // trampoline, collecting the return values into
+    // results.  See example_batched_invocation.cpp.
+    void invokeBatch(JS::HandleFunction fn,
+                     JS::HandleObject docs,
+                     JS::MutableHandleObject results);
+
+    // Whether the global at path (e.g. "Array.sum") is still
+    // the function object the prelude installed.  Paths
+    // starting with a privately installed type's class name
+    // ("BSONMyType.prototype.toNumber") resolve through
+    // that type's prototype.  Elided.
+    bool isPristineBuiltin(const char* path);
+
+    // Where emit() puts things during a map phase, or
+    // nullptr outside of one.  See example_sharded_map.cpp.
+    EmitCollector* getEmitCollector() const {
+        return _emitCollector;
+    }
+
+    void setEmitCollector(EmitCollector* collector) {
+        _emitCollector = collector;
+    }
+
+    // Delivers completions for async natives.  See
+    // example_async_natives.cpp.
+    EventLoop& getEventLoop() {
+        return _eventLoop;
+    }
+
+    // The local store behind readFile(), rooted at the
+    // shell's working directory.  Made on first use, so that
+    // scopes that never read a file don't start its threads.
+    FileStore& getFileStore() {
+        if (!_fileStore)
+            _fileStore = std::make_unique<FileStore>(".", 8);
+        return *_fileStore;
+    }
+
+    // Where print and the REPL's result echo write.  Flush
+    // it before anything waits on the user.  See
+    // example_output_sink.cpp.
+    OutputSink& getOutputSink() {
+        return *_outputSink;
+    }
+
+    // Swap in a different sink, returning the old one
+    std::unique_ptr<OutputSink> setOutputSink(
+        std::unique_ptr<OutputSink> sink) {
+        _outputSink->flush();
+        std::swap(sink, _outputSink);
+        return sink;
+    }
+
+    // Look up the WrapType instance for a given policy.
+    // Specialized below for each type we install.
+    template <typename T>
+    WrapType<T>& getProto();
+
+    // Every policy we install, one getProto specialization
+    // each.  Dispatch on a policy's hooks (structured clone,
+    // native printing) walks this list, so a new type only
+    // has to be added here.
+    template <typename... Ts>
+    struct TypeList {};
+
+    using InstalledTypes = TypeList<AdaptedMyTypeInfo,
+                                    SlotMyTypeInfo,
+                                    BSONMyTypeInfo,
+                                    LazyDocumentInfo>;
+
+    // The per context cache of shared instances for a type
+    // with an interned policy.  See
+    // example_interned_values.cpp.
+    template <typename T>
+    InternCache<T>& getInternCache();
+
+    // The per context map from native to live wrapper for a
+    // type with a weakIdentity policy.  See
+    // example_weak_identity.cpp.
+    template <typename T>
+    IdentityMap<T>& getIdentityMap();
+
+    // A snapshot of the GC numbers, with the per type
+    // finalization counts filled in.
+    struct GCReport {
+        GCStats gc;
+        std::map<std::string, uint64_t> finalized;
+    };
+
+    GCReport getGCReport();
+
+private:
+    static void gcSliceCallback(JSRuntime* rt,
+                                JS::GCProgress progress,
+                                const JS::GCDescription& desc);
+
+    // Called from the constructor, before any user script
+    // can touch the builtins.  See
+    // example_batched_invocation.cpp.
+    void installBatchTrampoline();
+
+    static bool interruptCallback(JSContext* cx);
+    void resetDeadline();
+    friend class ScopedDeadline;
+
+    static void finalizeCallback(JSFreeOp* fop,
+                                 JSFinalizeStatus status,
+                                 bool isCompartment,
+                                 void* data);
+
+    JSRuntime* _runtime;
+    JSContext* _context;
+    JS::PersistentRootedObject _global;
+
+    WrapType<AdaptedMyTypeInfo> _myTypeProto;
+    WrapType<SlotMyTypeInfo> _slotMyTypeProto;
+    InternCache<SlotMyTypeInfo> _slotMyTypeInterns;
+    WrapType<BSONMyTypeInfo> _bsonMyTypeProto;
+    IdentityMap<BSONMyTypeInfo> _bsonMyTypeIdentities;
+    WrapType<LazyDocumentInfo> _lazyDocumentProto;
+
+    // Slice callbacks don't take a closure, so we remember
+    // whoever was registered before us and chain to them.
+    JS::GCSliceCallback _prevSliceCallback = nullptr;
+
+    FieldNameCache _fieldNames;
+    JS::PersistentRootedFunction _batchTrampoline;
+    EmitCollector* _emitCollector = nullptr;
+
+    EventLoop _eventLoop;
+
+    // Destroyed before the event loop, so that no I/O
+    // thread can complete into a dead loop
+    std::unique_ptr<FileStore> _fileStore;
+
+    // Owned by the runtime once installed
+    MappedSourceHook* _sourceHook;
+
+    std::unique_ptr<OutputSink> _outputSink =
+        std::make_unique<OutputSink>(STDOUT_FILENO);
+
+    std::atomic<bool> _deadlineExceeded{false};
+
+    bool _preludeFromSnapshot = false;
+
+    GCStats _gcStats;
+    GCRecord _currentGC{};
+    std::chrono::steady_clock::time_point _sliceStart;
+    std::chrono::steady_clock::time_point _sweepStart;
+};
+
+template <>
+WrapType<AdaptedMyTypeInfo>&
+ImplScope::getProto<AdaptedMyTypeInfo>() {
+    return _myTypeProto;
+}
+
+template <>
+WrapType<SlotMyTypeInfo>&
+ImplScope::getProto<SlotMyTypeInfo>() {
+    return _slotMyTypeProto;
+}
+
+template <>
+WrapType<BSONMyTypeInfo>&
+ImplScope::getProto<BSONMyTypeInfo>() {
+    return _bsonMyTypeProto;
+}
+
+template <>
+WrapType<LazyDocumentInfo>&
+ImplScope::getProto<LazyDocumentInfo>() {
+    return _lazyDocumentProto;
+}
+
+template <>
+InternCache<SlotMyTypeInfo>&
+ImplScope::getInternCache<SlotMyTypeInfo>() {
+    return _slotMyTypeInterns;
+}
+
+template <>
+IdentityMap<BSONMyTypeInfo>&
+ImplScope::getIdentityMap<BSONMyTypeInfo>() {
+    return _bsonMyTypeIdentities;
+}
+
+ImplScope::ImplScope(JSRuntime* runtime,
+                     const std::string& preludeSnapshot)
+    : _runtime(runtime),
+      _context(JS_NewContext(_runtime, 8192)),
+      _global(_context),
+      _myTypeProto(_context),
+      _slotMyTypeProto(_context),
+      _slotMyTypeInterns(_context),
+      _bsonMyTypeProto(_context),
+      _bsonMyTypeIdentities(_context),
+      _lazyDocumentProto(_context),
+      _batchTrampoline(_context),
+      _eventLoop(_context) {
+    JS_SetRuntimePrivate(_runtime, this);
+    JS_SetContextPrivate(_context, this);
+
+    // ... create the global and install our types ...
+    // (_slotMyTypeProto as MyType, _myTypeProto as
+    // AdaptedMyType)
+
+    // Before anything captures the prelude's helpers
+    _preludeFromSnapshot = installPrelude(*this, preludeSnapshot);
+
+    _eventLoop.install(_global);
+    installBatchTrampoline();
+
+    JS_SetInterruptCallback(_runtime, interruptCallback);
+
+    _sourceHook = new MappedSourceHook;
+    js::SetSourceHook(
+        _runtime, mozilla::UniquePtr<js::SourceHook>(_sourceHook));
+
+    _prevSliceCallback =
+        JS::SetGCSliceCallback(_runtime, gcSliceCallback);
+
+    if (!JS_AddFinalizeCallback(
+            _runtime, finalizeCallback, this)) {
+        throw std::runtime_error(
+            "failed to register finalize callback");
+    }
+}
+
+ImplScope::~ImplScope() {
+    JS_RemoveFinalizeCallback(_runtime, finalizeCallback);
+    JS::SetGCSliceCallback(_runtime, _prevSliceCallback);
+
+    // ... tear down the context ...
+}
+
+// Each incremental slice is a separate pause, so that's the
+// granularity we time at.  Non-incremental collections
+// simply show up as a single slice.
+void ImplScope::gcSliceCallback(
+    JSRuntime* rt,
+    JS::GCProgress progress,
+    const JS::GCDescription& desc) {
+    auto& scope = fromRuntime(rt);
+    auto& current = scope._currentGC;
+    auto now = std::chrono::steady_clock::now();
+
+    switch (progress) {
+        case JS::GC_CYCLE_BEGIN:
+            current = GCRecord{
+                JS::gcreason::ExplainReason(desc.reason_),
+                0,
+                0,
+                0};
+            break;
+        case JS::GC_SLICE_BEGIN:
+            scope._sliceStart = now;
+            break;
+        case JS::GC_SLICE_END: {
+            uint64_t pause =
+                std::chrono::duration_cast<
+                    std::chrono::nanoseconds>(
+                    now - scope._sliceStart)
+                    .count();
+
+            current.slices++;
+            current.totalPauseNanos += pause;
+            current.maxSliceNanos =
+                std::max(current.maxSliceNanos, pause);
+            break;
+        }
+        case JS::GC_CYCLE_END: {
+            auto& stats = scope._gcStats;
+
+            stats.recent[stats.collections %
+                         GCStats::kHistory] = current;
+            stats.collections++;
+            stats.slices += current.slices;
+            stats.totalPauseNanos += current.totalPauseNanos;
+            stats.maxPauseNanos = std::max(
+                stats.maxPauseNanos, current.maxSliceNanos);
+            stats.reasons[current.reason]++;
+            break;
+        }
+    }
+
+    if (scope._prevSliceCallback)
+        scope._prevSliceCallback(rt, progress, desc);
+}
+
+// The finalize callback brackets sweeping, which is where
+// our own finalizers run.  Knowing how much of each pause
+// was spent there tells us how much the wrapped types are
+// costing us.
+void ImplScope::finalizeCallback(JSFreeOp* fop,
+                                 JSFinalizeStatus status,
+                                 bool isCompartment,
+                                 void* data) {
+    auto& scope = *static_cast<ImplScope*>(data);
+    auto now = std::chrono::steady_clock::now();
+
+    if (status == JSFINALIZE_GROUP_START) {
+        scope._sweepStart = now;
+    } else if (status == JSFINALIZE_GROUP_END) {
+        scope._gcStats.sweepNanos +=
+            std::chrono::duration_cast<
+                std::chrono::nanoseconds>(now -
+                                          scope._sweepStart)
+                .count();
+    }
+}
+
+// Per type counts come from the finalize trampoline that
+// WrapType installs in its JSClass.  The scope is reachable
+// from the JSFreeOp, and from there the WrapType instance
+// for T.
+template <typename T>
+void countingFinalize(JSFreeOp* fop, JSObject* obj) {
+    ImplScope::fromFreeOp(fop).getProto<T>().noteFinalized();
+    T::finalize(fop, obj);
+}
+
+ImplScope::GCReport ImplScope::getGCReport() {
+    GCReport report{_gcStats, {}};
+
+    // The slot backed MyType has no finalizer to count
+    report.finalized[AdaptedMyTypeInfo::className] =
+        _myTypeProto.getFinalizedCount();
+    report.finalized[BSONMyTypeInfo::className] =
+        _bsonMyTypeProto.getFinalizedCount();
+    report.finalized[LazyDocumentInfo::className] =
+        _lazyDocumentProto.getFinalizedCount();
+
+    return report;
+}
+
+// And finally the shell facing side.  gcStats() returns a
+// plain object, so it can be printed, diffed, or stuffed
+// into a document alongside a workload's own timings:
+//
+//     > gcStats()
+//     {
+//         "collections" : 12,
+//         "slices" : 31,
+//         "totalPauseMillis" : 84.2,
+//         "maxPauseMillis" : 11.7,
+//         "sweepMillis" : 40.1,
+//         "lastReason" : "ALLOC_TRIGGER",
+//         "reasons" : { "ALLOC_TRIGGER" : 11, "API" : 1 },
+//         "finalized" : { "AdaptedMyType" : 0,
+//                         "BSONMyType" : 1048576,
+//                         "Document" : 4096 }
+//     }
+struct GCStatsFunction {
+    static const char* name() {
+        return "gcStats";
+    }
+
+    static void call(JSContext* cx, JS::CallArgs args);
+};
+
+namespace {
+
+void setNumber(JSContext* cx,
+               JS::HandleObject obj,
+               const char* field,
+               double value) {
+    JS::RootedValue v(cx, JS::NumberValue(value));
+    if (!JS_SetProperty(cx, obj, field, v))
+        throw std::runtime_error(
+            std::string("failed to set ") + field);
+}
+
+void setCounts(JSContext* cx,
+               JS::HandleObject obj,
+               const char* field,
+               const std::map<std::string, uint64_t>& counts) {
+    JS::RootedObject sub(cx, JS_NewPlainObject(cx));
+    if (!sub)
+        throw std::runtime_error("failed to allocate");
+
+    for (const auto& kv : counts)
+        setNumber(cx, sub, kv.first.c_str(), kv.second);
+
+    JS::RootedValue v(cx, JS::ObjectValue(*sub));
+    if (!JS_SetProperty(cx, obj, field, v))
+        throw std::runtime_error(
+            std::string("failed to set ") + field);
+}
+
+double toMillis(uint64_t nanos) {
+    return nanos / 1e6;
+}
+
+}  // namespace
+
+void GCStatsFunction::call(JSContext* cx, JS::CallArgs args) {
+    auto report = ImplScope::fromContext(cx).getGCReport();
+    const auto& gc = report.gc;
+
+    JS::RootedObject out(cx, JS_NewPlainObject(cx));
+    if (!out)
+        throw std::runtime_error("failed to allocate");
+
+    setNumber(cx, out, "collections", gc.collections);
+    setNumber(cx, out, "slices", gc.slices);
+    setNumber(cx,
+              out,
+              "totalPauseMillis",
+              toMillis(gc.totalPauseNanos));
+    setNumber(
+        cx, out, "maxPauseMillis", toMillis(gc.maxPauseNanos));
+    setNumber(
+        cx, out, "sweepMillis", toMillis(gc.sweepNanos));
+
+    if (gc.collections) {
+        JS::RootedString str(
+            cx, JS_NewStringCopyZ(cx, gc.last().reason));
+        if (!str)
+            throw std::runtime_error("failed to allocate");
+
+        JS::RootedValue reason(cx, JS::StringValue(str));
+        if (!JS_SetProperty(cx, out, "lastReason", reason))
+            throw std::runtime_error(
+                "failed to set lastReason");
+    }
+
+    setCounts(cx, out, "reasons", gc.reasons);
+    setCounts(cx, out, "finalized", report.finalized);
+
+    args.rval().setObjectOrNull(out);
+}
+
+// Which is installed alongside the rest of the scope's free
+// functions:
+//
+//     JS_FN("gcStats", wrapFunction<GCStatsFunction>, 0, 0)
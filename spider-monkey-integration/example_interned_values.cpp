@@ -0,0 +1,148 @@
+// Even with MyType living in the nursery (see
+// example_nursery_values.cpp), counter heavy scripts spend
+// a lot of time allocating objects that hold 0, 1, -1, or
+// some other small number.  If the type is immutable there
+// is no reason for two of those to be different objects, so
+// let's hand out one shared instance per value instead.
+//
+// This is opt in, through the interned policy flag on
+// BaseInfo, because it is observable:
+//
+//     new MyType(1) === new MyType(1)  // now true
+//
+// and because it's only sound when nothing about an
+// instance can change after it's made.  A shared instance
+// that a script could set properties on would leak those
+// properties to every other user of the same value, so
+// cached instances are frozen.  Reserved slots aren't
+// properties, so freezing doesn't get in the way of our own
+// reads.
+//
+// Everything else stays the same.  Cached instances come
+// out of WrapType::newObject like any other, so they have
+// the right JSClass and prototype, pass instanceOf, and are
+// never the prototype itself.
+
+template <typename T>
+class InternCache {
+public:
+    static_assert(T::interned,
+                  "InternCache requires an interned policy");
+    static_assert(T::internMin <= T::internMax,
+                  "empty intern range");
+
+    explicit InternCache(JSContext* cx)
+        : _runtime(JS_GetRuntime(cx)),
+          _instances(T::internMax - T::internMin + 1) {
+        // The cache holds its instances strongly, for the
+        // life of the context, so it has to be a GC root.
+        if (!JS_AddExtraGCRootsTracer(
+                _runtime, trace, this)) {
+            throw std::runtime_error(
+                "failed to register intern cache tracer");
+        }
+    }
+
+    ~InternCache() {
+        JS_RemoveExtraGCRootsTracer(_runtime, trace, this);
+    }
+
+    InternCache(const InternCache&) = delete;
+    InternCache& operator=(const InternCache&) = delete;
+
+    static bool inRange(int64_t value) {
+        return value >= T::internMin && value <= T::internMax;
+    }
+
+    // Hand back the shared instance for value, making it on
+    // first use.  Out of range values always get a fresh
+    // object.
+    void get(JSContext* cx,
+             int64_t value,
+             JS::MutableHandleObject out) {
+        if (!inRange(value)) {
+            T::makeUncached(cx, value, out);
+            return;
+        }
+
+        auto& slot = _instances[value - T::internMin];
+
+        if (!slot) {
+            T::makeUncached(cx, value, out);
+
+            if (!JS_FreezeObject(cx, out))
+                throw std::runtime_error(
+                    "failed to freeze interned instance");
+
+            slot = out;
+            _misses++;
+        } else {
+            out.set(slot);
+            _hits++;
+        }
+    }
+
+    uint64_t hits() const {
+        return _hits;
+    }
+
+    uint64_t misses() const {
+        return _misses;
+    }
+
+private:
+    static void trace(JSTracer* trc, void* data) {
+        auto cache = static_cast<InternCache*>(data);
+
+        for (auto& instance : cache->_instances) {
+            if (instance) {
+                JS_CallObjectTracer(
+                    trc, &instance, "interned instance");
+            }
+        }
+    }
+
+    JSRuntime* _runtime;
+    std::vector<JS::Heap<JSObject*>> _instances;
+    uint64_t _hits = 0;
+    uint64_t _misses = 0;
+};
+
+// SlotMyTypeInfo::make now goes through the cache, so both
+// the script visible constructor and every native that
+// produces a MyType (add, conversions from BSON, ...) share
+// instances for values in [-1, 1024].
+//
+// The workload this is aimed at looks like the script
+// below: lots of MyType values that are small counters.
+// Run it with interned set to true and false and compare
+// wall time and GC counts.
+const char* const kCountersScript =
+    "var counts = [];\n"
+    "for (var i = 0; i < 10 * 1000 * 1000; i++) {\n"
+    "    counts[i % 1000] = new MyType(i % 16);\n"
+    "}\n";
+
+void benchmarkCounters(ImplScope& scope) {
+    using namespace std::chrono;
+
+    auto& cache = scope.getInternCache<SlotMyTypeInfo>();
+    JSRuntime* rt = JS_GetRuntime(scope.getContext());
+
+    auto hitsBefore = cache.hits();
+    auto gcBefore = JS_GetGCParameter(rt, JSGC_NUMBER);
+    auto start = steady_clock::now();
+
+    scope.exec(kCountersScript);
+
+    auto elapsed = steady_clock::now() - start;
+
+    std::cout
+        << "wall:  "
+        << duration_cast<milliseconds>(elapsed).count()
+        << " ms\n"
+        << "GCs:   "
+        << JS_GetGCParameter(rt, JSGC_NUMBER) - gcBefore
+        << "\n"
+        << "hits:  " << cache.hits() - hitsBefore << "\n";
+}
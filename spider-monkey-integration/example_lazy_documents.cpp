@@ -0,0 +1,357 @@
+// BaseInfo has had resolve and enumerate hooks since the
+// beginning, and until now nothing has used them.  Here's
+// the workload that finally justifies them:
+//
+//     db.coll.find({$where: "this.status == 'A'"})
+//
+// against documents with a couple of hundred fields.  We
+// convert the whole document into a JS object before
+// running the predicate, which looks at exactly one of
+// those fields.
+//
+// A lazy document instead keeps the BSON (via the
+// refcounted buffer from example_bson_backed_values.cpp)
+// and lets the engine ask for what it needs:
+//
+// - resolve is called the first time a property that the
+//   object doesn't have yet is looked up.  We find the
+//   field in the BSON, convert just that one value, and
+//   define it as a real property so that the next lookup
+//   never reaches us.
+// - enumerate hands back the field names only.  Values are
+//   still resolved one at a time, if and when they're read.
+// - writes land on the JS object, which is the overlay.  We
+//   only need to remember which fields were touched, so
+//   that converting back to BSON can copy the untouched
+//   ones straight from the buffer.  A resolved subdocument
+//   or array counts as touched, since it can be changed
+//   without us seeing a write.
+
+// What hangs off the private.  Field names are tracked as
+// std::string rather than jsid so that none of this needs
+// to be traced.
+struct LazyDocument {
+    LazyDocument(SharedBuffer* buffer, BSONObj obj)
+        : buffer(buffer), obj(std::move(obj)) {
+        buffer->retain();
+    }
+
+    ~LazyDocument() {
+        buffer->release();
+    }
+
+    SharedBuffer* buffer;
+    BSONObj obj;
+
+    // Fields written or added by the script, in the order
+    // they were first added
+    std::unordered_set<std::string> dirty;
+    std::vector<std::string> added;
+
+    // Fields deleted by the script.  resolve must not bring
+    // these back from the BSON.
+    std::unordered_set<std::string> deleted;
+
+    // Set while resolve defines a property, so that the
+    // addProperty hook doesn't mistake it for a write
+    bool resolving = false;
+};
+
+struct LazyDocumentInfo : public BaseInfo {
+    static void addProperty(JSContext* cx,
+                            JS::HandleObject obj,
+                            JS::HandleId id,
+                            JS::MutableHandleValue v);
+    static void delProperty(JSContext* cx,
+                            JS::HandleObject obj,
+                            JS::HandleId id,
+                            bool* succeeded);
+    static void enumerate(JSContext* cx,
+                          JS::HandleObject obj,
+                          JS::AutoIdVector& properties);
+    static void finalize(JSFreeOp* fop, JSObject* obj);
+    static void resolve(JSContext* cx,
+                        JS::HandleObject obj,
+                        JS::HandleId id,
+                        bool* resolvedp);
+    static void setProperty(JSContext* cx,
+                            JS::HandleObject obj,
+                            JS::HandleId id,
+                            bool strict,
+                            JS::MutableHandleValue vp);
+
+    static const char* const className;
+    static const InstallType installType =
+        InstallType::Private;
+    static const unsigned classFlags = JSCLASS_HAS_PRIVATE;
+
+    // Wrap obj, which must live in buffer
+    static void make(JSContext* cx,
+                     SharedBuffer* buffer,
+                     const BSONObj& obj,
+                     JS::MutableHandleObject out);
+
+    // Convert back, copying untouched fields straight from
+    // the original BSON
+    static BSONObj toBSON(JSContext* cx, JS::HandleObject obj);
+};
+
+const char* const LazyDocumentInfo::className = "Document";
+
+namespace {
+
+LazyDocument* getDocument(JSObject* obj) {
+    return static_cast<LazyDocument*>(JS_GetPrivate(obj));
+}
+
+// Property names as utf8.  Integer ids show up for fields
+// named "0", "1", ..., which arrays and some schemas use.
+std::string idToFieldName(JSContext* cx, JS::HandleId id) {
+    if (JSID_IS_INT(id))
+        return std::to_string(JSID_TO_INT(id));
+
+    JSAutoByteString bstr(cx, JSID_TO_STRING(id));
+    if (!bstr)
+        throw std::runtime_error("failed to convert field");
+
+    return bstr.ptr();
+}
+
+bool isFieldId(JS::HandleId id) {
+    return JSID_IS_STRING(id) || JSID_IS_INT(id);
+}
+
+}  // namespace
+
+void LazyDocumentInfo::make(JSContext* cx,
+                            SharedBuffer* buffer,
+                            const BSONObj& obj,
+                            JS::MutableHandleObject out) {
+    auto doc = std::make_unique<LazyDocument>(buffer, obj);
+
+    ImplScope::fromContext(cx)
+        .getProto<LazyDocumentInfo>()
+        .newObject(out);
+
+    if (!out)
+        throw std::runtime_error("failed to allocate");
+
+    JS_SetPrivate(out, doc.release());
+}
+
+void LazyDocumentInfo::finalize(JSFreeOp* fop,
+                                JSObject* obj) {
+    delete getDocument(obj);
+}
+
+void LazyDocumentInfo::resolve(JSContext* cx,
+                               JS::HandleObject obj,
+                               JS::HandleId id,
+                               bool* resolvedp) {
+    *resolvedp = false;
+
+    auto doc = getDocument(obj);
+
+    // The prototype has no document behind it
+    if (!doc || !isFieldId(id))
+        return;
+
+    auto field = idToFieldName(cx, id);
+
+    if (doc->deleted.count(field))
+        return;
+
+    // A linear scan of the field names, but no values are
+    // touched until we find the one we want.
+    auto elem = doc->obj.getField(field);
+    if (elem.eoo())
+        return;
+
+    JS::RootedValue value(cx);
+    bsonElementToJS(cx, doc->buffer, elem, &value);
+
+    doc->resolving = true;
+    bool ok = JS_DefinePropertyById(
+        cx, obj, id, value, JSPROP_ENUMERATE);
+    doc->resolving = false;
+
+    if (!ok)
+        throw std::runtime_error("failed to resolve field");
+
+    // Subdocuments and arrays can be changed in place
+    // (this.sub.x = 1, this.arr.push(2)) without a set on
+    // us, so once one is handed out it has to be written
+    // back from JS
+    if (elem.type() == Object || elem.type() == Array)
+        doc->dirty.insert(std::move(field));
+
+    *resolvedp = true;
+}
+
+void LazyDocumentInfo::enumerate(JSContext* cx,
+                                 JS::HandleObject obj,
+                                 JS::AutoIdVector& properties) {
+    auto doc = getDocument(obj);
+    if (!doc)
+        return;
+
+    JS::RootedId id(cx);
+
+    auto append = [&](const char* field) {
+        JS::RootedString name(cx,
+                              JS_InternString(cx, field));
+        if (!name)
+            throw std::runtime_error("failed to intern");
+
+        // Not INTERNED_STRING_TO_JSID: fields named "0",
+        // "1", ... have to come back as int ids, the same
+        // as the engine would make for them
+        if (!JS_StringToId(cx, name, &id))
+            throw std::runtime_error("failed to make id");
+
+        if (!properties.append(id))
+            throw std::runtime_error("failed to append");
+    };
+
+    for (const auto& elem : doc->obj) {
+        if (!doc->deleted.count(elem.fieldName()))
+            append(elem.fieldName());
+    }
+
+    for (const auto& field : doc->added) {
+        if (!doc->deleted.count(field))
+            append(field.c_str());
+    }
+}
+
+void LazyDocumentInfo::addProperty(JSContext* cx,
+                                   JS::HandleObject obj,
+                                   JS::HandleId id,
+                                   JS::MutableHandleValue v) {
+    auto doc = getDocument(obj);
+    if (!doc || doc->resolving || !isFieldId(id))
+        return;
+
+    auto field = idToFieldName(cx, id);
+
+    // Deleting and then re-adding a BSON field makes it an
+    // ordinary dirty field again
+    if (doc->deleted.erase(field) ||
+        !doc->obj.getField(field).eoo()) {
+        doc->dirty.insert(std::move(field));
+    } else if (doc->dirty.insert(field).second) {
+        doc->added.push_back(std::move(field));
+    }
+}
+
+void LazyDocumentInfo::setProperty(JSContext* cx,
+                                   JS::HandleObject obj,
+                                   JS::HandleId id,
+                                   bool strict,
+                                   JS::MutableHandleValue vp) {
+    auto doc = getDocument(obj);
+    if (!doc || !isFieldId(id))
+        return;
+
+    doc->dirty.insert(idToFieldName(cx, id));
+}
+
+void LazyDocumentInfo::delProperty(JSContext* cx,
+                                   JS::HandleObject obj,
+                                   JS::HandleId id,
+                                   bool* succeeded) {
+    *succeeded = true;
+
+    auto doc = getDocument(obj);
+    if (!doc || !isFieldId(id))
+        return;
+
+    auto field = idToFieldName(cx, id);
+    doc->dirty.erase(field);
+    doc->deleted.insert(std::move(field));
+}
+
+BSONObj LazyDocumentInfo::toBSON(JSContext* cx,
+                                 JS::HandleObject obj) {
+    auto doc = getDocument(obj);
+    BSONObjBuilder b;
+    JS::RootedValue value(cx);
+
+    auto appendFromJS = [&](const std::string& field) {
+        if (!JS_GetProperty(cx, obj, field.c_str(), &value))
+            throw std::runtime_error("failed to read field");
+        appendJSValue(cx, b, field, value);
+    };
+
+    // Untouched fields never leave their BSON form
+    for (const auto& elem : doc->obj) {
+        std::string field = elem.fieldName();
+
+        if (doc->deleted.count(field))
+            continue;
+
+        if (doc->dirty.count(field)) {
+            appendFromJS(field);
+        } else {
+            b.append(elem);
+        }
+    }
+
+    for (const auto& field : doc->added) {
+        if (!doc->deleted.count(field))
+            appendFromJS(field);
+    }
+
+    return b.obj();
+}
+
+// $where then calls the predicate with a lazy document as
+// this rather than a fully converted one.  To see the
+// difference, build documents with 200 fields and run a
+// predicate over one of them both ways.
+const char* const kOneFieldPredicate =
+    "function() { return this.f150 == 42; }";
+
+void benchmarkWhere(ImplScope& scope,
+                    const std::vector<BSONObj>& docs,
+                    SharedBuffer* buffer,
+                    bool lazy) {
+    using namespace std::chrono;
+
+    JSContext* cx = scope.getContext();
+    JSAutoRequest ar(cx);
+    JSAutoCompartment ac(cx, scope.getGlobal());
+
+    JS::RootedFunction predicate(cx);
+    scope.compileFunction(kOneFieldPredicate, &predicate);
+
+    JS::RootedObject thisv(cx);
+    JS::RootedValue rval(cx);
+    size_t matched = 0;
+
+    auto start = steady_clock::now();
+
+    for (const auto& obj : docs) {
+        if (lazy) {
+            LazyDocumentInfo::make(cx, buffer, obj, &thisv);
+        } else {
+            bsonToJS(cx, buffer, obj, &thisv);
+        }
+
+        if (!JS_CallFunction(cx,
+                             thisv,
+                             predicate,
+                             JS::HandleValueArray::empty(),
+                             &rval)) {
+            throw std::runtime_error("predicate failed");
+        }
+
+        matched += JS::ToBoolean(rval);
+    }
+
+    auto elapsed = steady_clock::now() - start;
+
+    std::cout << (lazy ? "lazy:  " : "eager: ")
+              << duration_cast<milliseconds>(elapsed).count()
+              << " ms, " << matched << " matched\n";
+}
@@ -0,0 +1,250 @@
+// Running a script file used to go like this: read the file
+// into a std::string, hand that to exec, which inflates it
+// to UTF-16 for the parser, and the engine then keeps its
+// own copy of the UTF-16 source for as long as any function
+// from the script is alive (for toString, and for compiling
+// lazily parsed functions later).  A 50MB generated script
+// holds 50MB of std::string and 100MB of UTF-16 at peak,
+// and keeps the 100MB around afterwards.
+//
+// None of those copies is necessary.  execFile:
+//
+// - maps the file instead of reading it, so the bytes live
+//   in the page cache and nowhere else,
+// - inflates straight out of the mapping into the one
+//   buffer the parser needs, and frees it once the script
+//   is compiled,
+// - compiles with setSourceIsLazy, which tells the engine
+//   not to keep the source at all.  When it needs the text
+//   again (toString on a function, mostly) it asks the
+//   runtime's source hook, which maps the file and inflates
+//   it again.  That only works while the file is the one we
+//   compiled, so a file edited between runs falls back to
+//   the engine keeping its copy.
+//
+// That last one isn't free.  Lazy function parsing, where a
+// function body is only checked up front and compiled on
+// its first call, needs the source at hand, so the engine
+// turns it off for scripts whose source is lazy.  execFile
+// pays a full parse of every function body at load time,
+// called or not, in exchange for the memory.
+//
+// The parser in the engine version we embed only reads
+// UTF-16, so one transient inflated copy is the floor:
+// there's no handing it Latin1 or UTF-8 directly.  What we
+// can do is make that copy cheap.  Most
+// scripts are pure ASCII, which widens in a straight loop;
+// anything else is decoded as UTF-8.
+//
+// Line and column numbers come out right because the
+// filename and starting line are the file's own, and the
+// only bytes we drop, a UTF-8 byte order mark, aren't
+// characters.
+
+// Enough of stat to notice the file changing under us
+struct FileIdentity {
+    dev_t device;
+    ino_t inode;
+    off_t size;
+    struct timespec modified;
+
+    explicit FileIdentity(const struct stat& st)
+        : device(st.st_dev),
+          inode(st.st_ino),
+          size(st.st_size),
+          modified(st.st_mtim) {}
+
+    bool operator==(const FileIdentity& other) const {
+        return device == other.device &&
+            inode == other.inode && size == other.size &&
+            modified.tv_sec == other.modified.tv_sec &&
+            modified.tv_nsec == other.modified.tv_nsec;
+    }
+};
+
+// Inflate a script file's bytes to the UTF-16 the parser
+// wants, into a buffer from js_malloc (which is what the
+// source hook has to return).
+bool inflateSource(JSContext* cx,
+                   const char* bytes,
+                   size_t size,
+                   char16_t** out,
+                   size_t* length) {
+    static const char kBOM[] = "\xEF\xBB\xBF";
+    if (size >= 3 && std::memcmp(bytes, kBOM, 3) == 0) {
+        bytes += 3;
+        size -= 3;
+    }
+
+    auto ubytes = reinterpret_cast<const unsigned char*>(bytes);
+    bool ascii = std::all_of(
+        ubytes, ubytes + size, [](unsigned char c) {
+            return c < 0x80;
+        });
+
+    if (!ascii) {
+        *out = JS::UTF8CharsToNewTwoByteCharsZ(
+                   cx, JS::UTF8Chars(bytes, size), length)
+                   .get();
+        return *out != nullptr;
+    }
+
+    auto chars = static_cast<char16_t*>(
+        js_malloc((size + 1) * sizeof(char16_t)));
+    if (!chars) {
+        JS_ReportOutOfMemory(cx);
+        return false;
+    }
+
+    for (size_t i = 0; i < size; i++)
+        chars[i] = ubytes[i];
+    chars[size] = 0;
+
+    *out = chars;
+    *length = size;
+    return true;
+}
+
+// Gives the engine back the source of scripts compiled with
+// setSourceIsLazy.  The filename is the path we compiled
+// from, and we only answer for files we compiled ourselves,
+// and only if they haven't changed since.  Handing back
+// different text than the engine compiled would have it
+// parse lazy functions at the wrong offsets.
+class MappedSourceHook : public js::SourceHook {
+public:
+    // Take responsibility for path's source, as of identity.
+    // A path can only have one identity: scripts compiled
+    // from an earlier version may still ask for that
+    // version's text, so once the file has changed the
+    // answer is false, and the caller has to let the engine
+    // keep the source of the new compile itself.
+    bool remember(const std::string& path,
+                  const FileIdentity& identity) {
+        std::lock_guard<std::mutex> lk(_mutex);
+        auto it = _files.emplace(path, identity).first;
+        return it->second == identity;
+    }
+
+    bool load(JSContext* cx,
+              const char* filename,
+              char16_t** src,
+              size_t* length) override {
+        *src = nullptr;
+
+        std::unique_lock<std::mutex> lk(_mutex);
+        auto it = _files.find(filename);
+        if (it == _files.end())
+            return true;  // not ours: no source available
+        auto identity = it->second;
+        lk.unlock();
+
+        MappedFile file(filename);
+        if (!file.data() ||
+            !(FileIdentity(file.stat()) == identity)) {
+            JS_ReportError(cx,
+                           "source of %s changed since it was "
+                           "compiled",
+                           filename);
+            return false;
+        }
+
+        return inflateSource(
+            cx, file.data(), file.size(), src, length);
+    }
+
+private:
+    std::mutex _mutex;
+    std::unordered_map<std::string, FileIdentity> _files;
+};
+
+void ImplScope::execFile(const std::string& path,
+                         JS::MutableHandleValue rval) {
+    JSAutoRequest ar(_context);
+    JSAutoCompartment ac(_context, _global);
+
+    // An empty file can't be mapped, and has nothing to run
+    MappedFile file(path);
+    if (!file.data()) {
+        struct stat st;
+        if (::stat(path.c_str(), &st) != 0 || st.st_size != 0)
+            throw std::runtime_error("failed to map " + path);
+        rval.setUndefined();
+        return;
+    }
+
+    char16_t* chars;
+    size_t length;
+    if (!inflateSource(
+            _context, file.data(), file.size(), &chars, &length))
+        throwCurrentJSException(_context,
+                                "failed to decode " + path);
+    std::unique_ptr<char16_t[], JS::FreePolicy> owned(chars);
+
+    // Before compiling: a lazy function can be asked for
+    // its source as soon as the script runs.  A file that
+    // has changed since we first ran it is compiled with its
+    // source kept, like any other script.
+    bool lazy =
+        _sourceHook->remember(path, FileIdentity(file.stat()));
+
+    JS::CompileOptions opts(_context);
+    opts.setFileAndLine(path.c_str(), 1).setSourceIsLazy(lazy);
+
+    JS::SourceBufferHolder srcBuf(
+        chars, length, JS::SourceBufferHolder::NoOwnership);
+    if (!JS::Evaluate(_context, _global, opts, srcBuf, rval))
+        throwCurrentJSException(_context, "failed to run " + path);
+}
+
+// Writes size bytes or so of generated script to path, for
+// the benchmark.  Same shape as the off thread compile one.
+void writeGeneratedScript(const std::string& path, size_t size) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out << generateScript(0, size);
+}
+
+// Peak RSS only goes up, so each mode needs a process of its
+// own: run this once with mapped false and once with it
+// true, on a script of 10MB, 100MB and so on.  ru_maxrss is
+// in kilobytes on Linux.
+//
+// Don't read execFile's load time as the cost of copies
+// alone.  It also pays the full parse of every function
+// that lazy source forces (see above), which on a library
+// of mostly uncalled functions can outweigh the copies it
+// saves.  The memory difference is the copies.
+void benchmarkSourceLoading(ImplScope& scope,
+                            const std::string& path,
+                            bool mapped) {
+    using namespace std::chrono;
+
+    JSContext* cx = scope.getContext();
+    JS::RootedValue rval(cx);
+
+    struct rusage before;
+    ::getrusage(RUSAGE_SELF, &before);
+
+    auto start = steady_clock::now();
+    if (mapped) {
+        scope.execFile(path, &rval);
+    } else {
+        std::ifstream in(path, std::ios::binary);
+        std::string source((std::istreambuf_iterator<char>(in)),
+                           std::istreambuf_iterator<char>());
+        scope.exec(source, &rval);
+    }
+    auto elapsed = steady_clock::now() - start;
+
+    struct rusage after;
+    ::getrusage(RUSAGE_SELF, &after);
+
+    std::cout << (mapped ? "execFile" : "exec    ") << ": "
+              << duration_cast<milliseconds>(elapsed).count()
+              << " ms, peak RSS " << after.ru_maxrss / 1024
+              << " MB (+"
+              << (after.ru_maxrss - before.ru_maxrss) / 1024
+              << " MB)"
+              << (mapped ? ", functions parsed eagerly" : "")
+              << "\n";
+}
@@ -0,0 +1,531 @@
+// The shell prints a result by calling tojson on it, and
+// tojson is JavaScript: for every MyType in a document it
+// looks up toString through the prototype chain, calls
+// into our native, gets back a fresh JS string, and
+// concatenates that into a bigger JS string, which is
+// eventually converted to UTF-8 for the terminal.  Printing
+// a hundred thousand documents makes millions of strings
+// that exist only to be glued together.
+//
+// Printing natively skips all of that.  The printer walks
+// the value in C++ and writes UTF-8 straight into a
+// growable buffer:
+//
+// - Objects made by one of our WrapTypes are recognized by
+//   their JSClass pointer, and the type's print hook writes
+//   its representation directly.  MyType writes
+//   MyType("123") without making a string on either side.
+// - Strings are read in place (see
+//   example_string_views.cpp) and escaped into the buffer.
+// - Numbers, booleans, null, arrays, plain objects and
+//   types with an enumerate hook (lazy documents) are
+//   handled inline.
+// - Anything else (dates, regular expressions, functions)
+//   goes through JS_Stringify, whose output callback also
+//   writes into the buffer.
+//
+// The output is tojson's: JSON, except that wrapped types
+// print as constructor calls, undefined prints as
+// undefined, and non-finite numbers print as NaN, Infinity
+// and -Infinity.
+
+// A growable UTF-8 buffer.  clear() keeps the capacity, so
+// a buffer reused across prints stops allocating once it's
+// grown to fit.
+class OutputBuffer {
+public:
+    void append(char c) {
+        _buf += c;
+    }
+
+    void append(std::string_view s) {
+        _buf.append(s.data(), s.size());
+    }
+
+    void appendInt64(int64_t value) {
+        char digits[24];
+        auto result =
+            std::to_chars(digits, digits + sizeof(digits), value);
+        _buf.append(digits, result.ptr - digits);
+    }
+
+    void appendCodePoint(uint32_t cp) {
+        appendUTF8(_buf, cp);
+    }
+
+    const char* data() const {
+        return _buf.data();
+    }
+
+    size_t size() const {
+        return _buf.size();
+    }
+
+    void clear() {
+        _buf.clear();
+    }
+
+    // Drop everything after the first size bytes, to undo a
+    // partial print
+    void truncate(size_t size) {
+        _buf.resize(std::min(size, _buf.size()));
+    }
+
+    // Drop the first n bytes, once they've been written out
+    void consume(size_t n) {
+        _buf.erase(0, n);
+    }
+
+private:
+    std::string _buf;
+};
+
+namespace {
+
+template <typename T>
+constexpr bool hasPrint() {
+    return &T::print != &BaseInfo::print;
+}
+
+// The prototype shares the class but has no value, so it
+// takes the generic path like any other object.  Types
+// without a print hook drop out at compile time.
+template <typename T>
+bool printIfType(ImplScope& scope,
+                 JS::HandleObject obj,
+                 OutputBuffer& out) {
+    if constexpr (!hasPrint<T>()) {
+        return false;
+    } else {
+        auto& proto = scope.getProto<T>();
+        if (JS_GetClass(obj) != proto.getJSClass() ||
+            obj == proto.getProto())
+            return false;
+
+        T::print(scope.getContext(), obj, out);
+        return true;
+    }
+}
+
+template <typename... Ts>
+bool printWrapped(ImplScope& scope,
+                  JS::HandleObject obj,
+                  OutputBuffer& out,
+                  ImplScope::TypeList<Ts...>) {
+    return (printIfType<Ts>(scope, obj, out) || ...);
+}
+
+}  // namespace
+
+class NativePrinter {
+public:
+    explicit NativePrinter(ImplScope& scope)
+        : _scope(scope), _cx(scope.getContext()) {}
+
+    // Append v's printed form to out
+    void print(JS::HandleValue v, OutputBuffer& out) {
+        printValue(v, out, 0);
+    }
+
+private:
+    // Deep enough for any real document.  Deeper than this
+    // is almost certainly a cycle.
+    static constexpr unsigned kMaxDepth = 150;
+
+    void printValue(JS::HandleValue v,
+                    OutputBuffer& out,
+                    unsigned depth);
+    void printObject(JS::HandleObject obj,
+                     OutputBuffer& out,
+                     unsigned depth);
+    void printString(JSString* str, OutputBuffer& out);
+    void printNumber(double d, OutputBuffer& out);
+    void printFallback(JS::HandleValue v, OutputBuffer& out);
+
+    ImplScope& _scope;
+    JSContext* _cx;
+};
+
+void NativePrinter::printValue(JS::HandleValue v,
+                               OutputBuffer& out,
+                               unsigned depth) {
+    if (v.isInt32()) {
+        out.appendInt64(v.toInt32());
+    } else if (v.isDouble()) {
+        printNumber(v.toDouble(), out);
+    } else if (v.isString()) {
+        printString(v.toString(), out);
+    } else if (v.isBoolean()) {
+        out.append(v.toBoolean() ? "true" : "false");
+    } else if (v.isNull()) {
+        out.append("null");
+    } else if (v.isUndefined()) {
+        out.append("undefined");
+    } else if (v.isObject()) {
+        if (depth >= kMaxDepth)
+            throw std::runtime_error(
+                "value too deeply nested to print (cyclic?)");
+
+        JS::RootedObject obj(_cx, &v.toObject());
+        printObject(obj, out, depth + 1);
+    } else {
+        printFallback(v, out);
+    }
+}
+
+void NativePrinter::printObject(JS::HandleObject obj,
+                                OutputBuffer& out,
+                                unsigned depth) {
+    if (printWrapped(
+            _scope, obj, out, ImplScope::InstalledTypes()))
+        return;
+
+    bool isArray;
+    if (!JS_IsArrayObject(_cx, obj, &isArray))
+        throwCurrentJSException(_cx, "failed to inspect value");
+
+    JS::RootedValue elem(_cx);
+
+    if (isArray) {
+        uint32_t length;
+        if (!JS_GetArrayLength(_cx, obj, &length))
+            throwCurrentJSException(_cx, "failed to get length");
+
+        out.append('[');
+        for (uint32_t i = 0; i < length; i++) {
+            if (i)
+                out.append(',');
+            if (!JS_GetElement(_cx, obj, i, &elem))
+                throwCurrentJSException(_cx,
+                                        "failed to get element");
+            printValue(elem, out, depth);
+        }
+        out.append(']');
+        return;
+    }
+
+    // Plain objects, and our own types that enumerate their
+    // fields (LazyDocument's "Document"), print field by
+    // field.  Dates, regular expressions and the rest keep
+    // their JSON.stringify form.
+    auto clasp = JS_GetClass(obj);
+    if (std::strcmp(clasp->name, "Object") != 0 &&
+        !clasp->enumerate) {
+        JS::RootedValue v(_cx, JS::ObjectValue(*obj));
+        printFallback(v, out);
+        return;
+    }
+
+    JS::AutoIdArray ids(_cx, JS_Enumerate(_cx, obj));
+    if (!ids)
+        throwCurrentJSException(_cx, "failed to enumerate");
+
+    JS::RootedId id(_cx);
+
+    bool first = true;
+
+    out.append('{');
+    for (size_t i = 0; i < ids.length(); i++) {
+        id = ids[i];
+
+        // Enumerate doesn't produce symbols, and nothing else
+        // has ids
+        if (!JSID_IS_STRING(id) && !JSID_IS_INT(id))
+            continue;
+
+        if (!first)
+            out.append(',');
+        first = false;
+
+        if (JSID_IS_STRING(id)) {
+            printString(JSID_TO_STRING(id), out);
+        } else {
+            out.append('"');
+            out.appendInt64(JSID_TO_INT(id));
+            out.append('"');
+        }
+
+        out.append(':');
+        if (!JS_GetPropertyById(_cx, obj, id, &elem))
+            throwCurrentJSException(_cx,
+                                    "failed to get property");
+        printValue(elem, out, depth);
+    }
+    out.append('}');
+}
+
+// JSON string escaping, over whichever chars the string
+// has.  Lone surrogates are escaped rather than encoded, so
+// the output is always valid UTF-8.
+void NativePrinter::printString(JSString* str,
+                                OutputBuffer& out) {
+    JS::RootedValue v(_cx, JS::StringValue(str));
+    StringArg chars(_cx, v);
+
+    auto escape = [&](uint32_t c) {
+        static const char kHex[] = "0123456789abcdef";
+
+        switch (c) {
+            case '"':
+                out.append("\\\"");
+                return;
+            case '\\':
+                out.append("\\\\");
+                return;
+            case '\n':
+                out.append("\\n");
+                return;
+            case '\r':
+                out.append("\\r");
+                return;
+            case '\t':
+                out.append("\\t");
+                return;
+            case '\b':
+                out.append("\\b");
+                return;
+            case '\f':
+                out.append("\\f");
+                return;
+        }
+
+        if (c < 0x20 || (c >= 0xD800 && c <= 0xDFFF)) {
+            char escaped[] = {'\\',
+                              'u',
+                              kHex[(c >> 12) & 0xF],
+                              kHex[(c >> 8) & 0xF],
+                              kHex[(c >> 4) & 0xF],
+                              kHex[c & 0xF]};
+            out.append(
+                std::string_view(escaped, sizeof(escaped)));
+        } else {
+            out.appendCodePoint(c);
+        }
+    };
+
+    out.append('"');
+
+    if (chars.isLatin1()) {
+        for (unsigned char c : chars.latin1())
+            escape(c);
+    } else {
+        auto u16 = chars.twoByte();
+        for (size_t i = 0; i < u16.size(); i++) {
+            uint32_t c = u16[i];
+
+            bool lead = c >= 0xD800 && c <= 0xDBFF;
+            bool trail = i + 1 < u16.size() &&
+                u16[i + 1] >= 0xDC00 && u16[i + 1] <= 0xDFFF;
+
+            if (lead && trail) {
+                c = 0x10000 + ((c - 0xD800) << 10) +
+                    (u16[++i] - 0xDC00);
+            }
+
+            escape(c);
+        }
+    }
+
+    out.append('"');
+}
+
+// Number to string the way JS does it: the shortest digits
+// that round trip, in fixed notation from 1e-6 up to 1e21
+// and exponential outside that, with no leading zeros in
+// the exponent.
+void NativePrinter::printNumber(double d, OutputBuffer& out) {
+    if (std::isnan(d)) {
+        out.append("NaN");
+        return;
+    }
+    if (std::isinf(d)) {
+        out.append(d > 0 ? "Infinity" : "-Infinity");
+        return;
+    }
+    if (d == 0) {
+        out.append('0');  // including -0, as JS prints it
+        return;
+    }
+
+    char digits[64];
+    auto magnitude = std::fabs(d);
+    auto format = magnitude >= 1e-6 && magnitude < 1e21
+        ? std::chars_format::fixed
+        : std::chars_format::scientific;
+    auto end = std::to_chars(
+                   digits, digits + sizeof(digits), d, format)
+                   .ptr;
+
+    std::string_view written(digits, end - digits);
+    auto e = written.find('e');
+    if (e == std::string_view::npos) {
+        out.append(written);
+        return;
+    }
+
+    // "1.5e-07" to "1.5e-7"
+    out.append(written.substr(0, e + 2));
+    auto exponent = written.substr(e + 2);
+    while (exponent.size() > 1 && exponent.front() == '0')
+        exponent.remove_prefix(1);
+    out.append(exponent);
+}
+
+// Whatever JSON.stringify makes of it, written through its
+// callback.  Functions and the like stringify to nothing,
+// and print as undefined.
+void NativePrinter::printFallback(JS::HandleValue v,
+                                  OutputBuffer& out) {
+    // A surrogate pair may be split across two calls
+    struct Sink {
+        OutputBuffer& out;
+        bool wrote;
+        char16_t lead;
+    } sink{out, false, 0};
+
+    auto callback = [](const char16_t* buf,
+                       uint32_t len,
+                       void* data) {
+        auto sink = static_cast<Sink*>(data);
+
+        for (uint32_t i = 0; i < len; i++) {
+            uint32_t c = buf[i];
+
+            if (sink->lead) {
+                if (c >= 0xDC00 && c <= 0xDFFF) {
+                    c = 0x10000 + ((sink->lead - 0xD800) << 10) +
+                        (c - 0xDC00);
+                } else {
+                    sink->out.appendCodePoint(0xFFFD);
+                }
+                sink->lead = 0;
+            } else if (c >= 0xD800 && c <= 0xDBFF) {
+                sink->lead = c;
+                continue;
+            }
+
+            sink->out.appendCodePoint(c >= 0xD800 && c <= 0xDFFF
+                                          ? 0xFFFD
+                                          : c);
+        }
+
+        sink->wrote = sink->wrote || len;
+        return true;
+    };
+
+    JS::RootedValue value(_cx, v);
+    if (!JS_Stringify(_cx,
+                      &value,
+                      JS::NullPtr(),
+                      JS::NullHandleValue,
+                      callback,
+                      &sink)) {
+        throwCurrentJSException(_cx, "failed to print value");
+    }
+
+    if (sink.lead)
+        out.appendCodePoint(0xFFFD);
+    if (!sink.wrote)
+        out.append("undefined");
+}
+
+void SlotMyTypeInfo::print(JSContext*,
+                           JS::HandleObject obj,
+                           OutputBuffer& out) {
+    out.append("MyType(\"");
+    out.appendInt64(getValue(obj));
+    out.append("\")");
+}
+
+void BSONMyTypeInfo::print(JSContext*,
+                           JS::HandleObject obj,
+                           OutputBuffer& out) {
+    out.append("MyType(\"");
+    out.appendInt64(getValue(obj));
+    out.append("\")");
+}
+
+// The script side equivalent, for comparison: what the
+// shell's tojson does, reduced to the cases in the
+// benchmark's documents.
+const char* const kScriptToJSON = R"js(
+function tojsonScript(v) {
+    if (v instanceof MyType)
+        return 'MyType("' + v.toString() + '")';
+    if (Array.isArray(v))
+        return '[' + v.map(tojsonScript).join(',') + ']';
+    if (v !== null && typeof v == 'object') {
+        var parts = [];
+        for (var k in v) {
+            if (v.hasOwnProperty(k))
+                parts.push(JSON.stringify(k) + ':' +
+                           tojsonScript(v[k]));
+        }
+        return '{' + parts.join(',') + '}';
+    }
+    return v === undefined ? 'undefined' : JSON.stringify(v);
+}
+
+var docs = [];
+for (var i = 0; i < 100000; i++) {
+    docs.push({
+        _id: i,
+        name: "document " + i,
+        total: new MyType(String(i * 7919)),
+        items: [new MyType("1"), new MyType(String(i)), 2.5],
+        tags: ["a", "b\n"],
+    });
+}
+)js";
+
+// 100K documents printed both ways, one per line as the
+// shell would, checking that the output matches
+void benchmarkPrinting(ImplScope& scope) {
+    using namespace std::chrono;
+
+    JSContext* cx = scope.getContext();
+    JSAutoRequest ar(cx);
+    JSAutoCompartment ac(cx, scope.getGlobal());
+
+    scope.exec(kScriptToJSON);
+
+    JS::RootedValue result(cx);
+
+    auto start = steady_clock::now();
+    scope.exec("docs.map(tojsonScript).join('\\n') + '\\n'",
+               &result);
+    auto script = StringArg(cx, result).toUTF8();
+    auto scriptTime = steady_clock::now() - start;
+
+    JS::RootedValue docsValue(cx);
+    scope.exec("docs", &docsValue);
+    JS::RootedObject docs(cx, &docsValue.toObject());
+    JS::RootedValue doc(cx);
+
+    OutputBuffer out;
+    NativePrinter printer(scope);
+
+    start = steady_clock::now();
+    uint32_t length;
+    if (!JS_GetArrayLength(cx, docs, &length))
+        throwCurrentJSException(cx, "failed to get length");
+    for (uint32_t i = 0; i < length; i++) {
+        if (!JS_GetElement(cx, docs, i, &doc))
+            throwCurrentJSException(cx, "failed to get element");
+        printer.print(doc, out);
+        out.append('\n');
+    }
+    auto nativeTime = steady_clock::now() - start;
+
+    bool match =
+        std::string_view(out.data(), out.size()) == script;
+
+    std::cout << "tojson (script): "
+              << duration_cast<milliseconds>(scriptTime).count()
+              << " ms\n"
+              << "native printer:  "
+              << duration_cast<milliseconds>(nativeTime).count()
+              << " ms\n"
+              << (match ? "outputs match" : "OUTPUTS DIFFER")
+              << "\n";
+}
@@ -0,0 +1,431 @@
+// Look at enough mapReduce jobs and you'll notice that the
+// reduce function is usually one of a handful of things:
+//
+//     function(key, values) { return Array.sum(values); }
+//
+// or a hand rolled loop doing the same, or a min, or a max.
+// Every one of those runs through the interpreter or the
+// JIT, after every emitted value has been converted from
+// BSON into JS, only to be summed and converted back.
+//
+// If we can recognize the function, we can skip JS
+// entirely and reduce the BSON values in C++.  The trick is
+// to be conservative: anything we don't recognize with
+// certainty, or any input our native version wouldn't
+// handle exactly the way the JS would, goes down the normal
+// path.  Nobody should be able to tell the fast path ran,
+// other than by the clock.
+
+enum class ReducerShape : char {
+    None = 0,
+    Sum,       // Array.sum(values)
+    SumLoop,   // The same, as a loop starting from 0
+    Count,     // values.length
+    Min,       // Math.min.apply(Math, values)
+    Max,       // Math.max.apply(Math, values)
+    SumMyType  // Array.sum of values[i].toNumber()
+};
+
+// Recognition works on a normalized token stream rather
+// than the raw source, so whitespace, comments, and the
+// names people choose for their parameters and locals
+// don't matter.  Parameters become $0, $1, ... and
+// anything else introduced with var or as an inner
+// function's parameter becomes $L0, $L1, ...  Identifiers
+// that aren't bound locally (Array, Math, sum, length) are
+// kept as is.
+//
+// String literals never appear in the canonical shapes, so
+// a function containing one is simply rejected.
+class ReducerFingerprint {
+public:
+    static ReducerShape recognize(const std::string& source);
+
+private:
+    static bool normalize(const std::string& source,
+                          std::string* out);
+};
+
+namespace {
+
+const std::pair<const char*, ReducerShape> kShapes[] = {
+    {"function($0,$1){return Array.sum($1);}",
+     ReducerShape::Sum},
+    {"function($0,$1){var $L0=0;for(var $L1=0;$L1<$1.length;"
+     "$L1++){$L0+=$1[$L1];}return $L0;}",
+     ReducerShape::SumLoop},
+    {"function($0,$1){return $1.length;}",
+     ReducerShape::Count},
+    {"function($0,$1){return Math.min.apply(Math,$1);}",
+     ReducerShape::Min},
+    {"function($0,$1){return Math.max.apply(Math,$1);}",
+     ReducerShape::Max},
+    {"function($0,$1){return Array.sum($1.map(function($L0)"
+     "{return $L0.toNumber();}));}",
+     ReducerShape::SumMyType},
+};
+
+bool isIdentStart(char c) {
+    return std::isalpha(static_cast<unsigned char>(c)) ||
+        c == '_' || c == '$';
+}
+
+bool isIdentPart(char c) {
+    return isIdentStart(c) ||
+        std::isdigit(static_cast<unsigned char>(c));
+}
+
+}  // namespace
+
+bool ReducerFingerprint::normalize(const std::string& source,
+                                   std::string* out) {
+    std::unordered_map<std::string, std::string> renames;
+    size_t params = 0;
+    size_t locals = 0;
+
+    // What the previous tokens tell us about the next
+    // identifier
+    bool afterFunction = false;
+    bool inParams = false;
+    bool outerParams = true;
+    bool afterVar = false;
+
+    // Keep adjacent words apart ("return x", "var i"), but
+    // drop every other bit of whitespace
+    auto append = [&](const std::string& token) {
+        if (!out->empty() && isIdentPart(out->back()) &&
+            isIdentPart(token[0]))
+            *out += ' ';
+        *out += token;
+    };
+
+    for (size_t i = 0; i < source.size();) {
+        char c = source[i];
+
+        if (std::isspace(static_cast<unsigned char>(c))) {
+            i++;
+        } else if (c == '/' && i + 1 < source.size() &&
+                   (source[i + 1] == '/' ||
+                    source[i + 1] == '*')) {
+            bool line = source[i + 1] == '/';
+            auto end = line ? source.find('\n', i)
+                            : source.find("*/", i + 2);
+
+            // A line comment may run to the end of the
+            // source; an unterminated block comment is a
+            // syntax error we leave for the engine
+            if (end == std::string::npos)
+                return line;
+
+            i = end + (line ? 1 : 2);
+        } else if (c == '"' || c == '\'' || c == '`') {
+            return false;
+        } else if (isIdentPart(c)) {
+            size_t start = i;
+            while (i < source.size() && isIdentPart(source[i]))
+                i++;
+
+            std::string ident = source.substr(start, i - start);
+
+            // Property names after a dot are never renamed
+            bool isProperty = !out->empty() && out->back() == '.';
+
+            if (inParams) {
+                renames[ident] = outerParams
+                    ? "$" + std::to_string(params++)
+                    : "$L" + std::to_string(locals++);
+            } else if (afterVar) {
+                renames[ident] = "$L" + std::to_string(locals++);
+            }
+
+            auto it = renames.find(ident);
+            append((!isProperty && it != renames.end())
+                       ? it->second
+                       : ident);
+
+            // A name between function and its parameter
+            // list leaves afterFunction set
+            afterFunction |= ident == "function";
+            afterVar = ident == "var";
+        } else {
+            if (c == '(' && afterFunction) {
+                inParams = true;
+            } else if (c == ')' && inParams) {
+                inParams = false;
+                outerParams = false;
+            }
+
+            append(std::string(1, c));
+            afterFunction = false;
+            afterVar = false;
+            i++;
+        }
+    }
+
+    return true;
+}
+
+ReducerShape ReducerFingerprint::recognize(
+    const std::string& source) {
+    std::string normalized;
+    if (!normalize(source, &normalized))
+        return ReducerShape::None;
+
+    for (const auto& shape : kShapes) {
+        if (normalized == shape.first)
+            return shape.second;
+    }
+
+    return ReducerShape::None;
+}
+
+// Now the reducers themselves.  They work directly on the
+// emitted BSON values and return false if the input is
+// anything other than what they know how to handle
+// exactly.
+
+namespace {
+
+// 2^53: below this, every integer is an exact double
+constexpr double kMaxExactDouble = 9007199254740992.0;
+
+// Array.sum is a left fold of +.  Floating point addition
+// isn't associative, so we can only reorder (and thus
+// vectorize) when every partial sum in every order is
+// exact: all values integral and the sum of their
+// magnitudes below 2^53.  In that case we sum as int64 with
+// independent accumulators the compiler can put in SIMD
+// lanes.  Otherwise we fold left to right in double, which
+// is exactly what the JS would have done.
+//
+// Array.sum starts the fold from the first value, and a
+// loop starting from 0 from +0.  The two only differ when
+// every value is -0: +0 + -0 is +0.
+double sumDoubles(const std::vector<double>& values,
+                  bool fromZero) {
+    bool integral = true;
+    bool allNegativeZero = true;
+    double magnitude = 0;
+
+    for (double v : values) {
+        integral &= v == std::trunc(v);
+        allNegativeZero &= v == 0 && std::signbit(v);
+        magnitude += std::fabs(v);
+    }
+
+    // -0 + -0 is the only way to get -0 out of the fold,
+    // and int64 can't represent it
+    if (allNegativeZero)
+        return fromZero ? 0.0 : -0.0;
+
+    if (integral && magnitude < kMaxExactDouble) {
+        int64_t acc[4] = {0, 0, 0, 0};
+        size_t n = values.size();
+        size_t i = 0;
+
+        for (; i + 4 <= n; i += 4) {
+            acc[0] += static_cast<int64_t>(values[i]);
+            acc[1] += static_cast<int64_t>(values[i + 1]);
+            acc[2] += static_cast<int64_t>(values[i + 2]);
+            acc[3] += static_cast<int64_t>(values[i + 3]);
+        }
+
+        for (; i < n; i++)
+            acc[0] += static_cast<int64_t>(values[i]);
+
+        return static_cast<double>(acc[0] + acc[1] + acc[2] +
+                                   acc[3]);
+    }
+
+    double sum = values[0];
+    for (size_t i = 1; i < values.size(); i++)
+        sum += values[i];
+
+    return sum;
+}
+
+// Math.min and Math.max have opinions about NaN and signed
+// zero that std::min and std::max don't share, so these
+// stay scalar.
+double jsMinMax(const std::vector<double>& values, bool max) {
+    double result = max ? -INFINITY : INFINITY;
+
+    for (double v : values) {
+        if (std::isnan(v))
+            return v;
+
+        bool better = max ? v > result : v < result;
+        bool zeroTie = v == 0 && result == 0 &&
+            std::signbit(v) != max;
+
+        if (better || zeroTie)
+            result = v;
+    }
+
+    return result;
+}
+
+}  // namespace
+
+// Returns false if the values aren't all of the expected
+// BSON type, in which case the caller runs the reduce
+// function in JS as usual.  On success appends the result
+// to out under fieldName, as the JS result would have been.
+bool nativeReduce(ReducerShape shape,
+                  const std::vector<BSONElement>& values,
+                  StringData fieldName,
+                  BSONObjBuilder& out) {
+    // Array.sum([]) is null, Math.min() is Infinity, and so
+    // on.  Not worth special casing; let JS sort it out.
+    if (shape == ReducerShape::None || values.empty())
+        return false;
+
+    if (shape == ReducerShape::Count) {
+        out.append(fieldName,
+                   static_cast<double>(values.size()));
+        return true;
+    }
+
+    std::vector<double> numbers;
+    numbers.reserve(values.size());
+
+    for (const auto& elem : values) {
+        if (shape == ReducerShape::SumMyType) {
+            // toNumber() of a NumberLong is a double
+            // conversion, just like this
+            if (elem.type() != NumberLong)
+                return false;
+            numbers.push_back(
+                static_cast<double>(elem.numberLong()));
+        } else {
+            // NumberLong would be a MyType in JS, where +
+            // means something quite different
+            if (elem.type() != NumberDouble &&
+                elem.type() != NumberInt)
+                return false;
+            numbers.push_back(elem.numberDouble());
+        }
+    }
+
+    switch (shape) {
+        case ReducerShape::Sum:
+        case ReducerShape::SumMyType:
+            out.append(fieldName, sumDoubles(numbers, false));
+            break;
+        case ReducerShape::SumLoop:
+            out.append(fieldName, sumDoubles(numbers, true));
+            break;
+        case ReducerShape::Min:
+            out.append(fieldName, jsMinMax(numbers, false));
+            break;
+        case ReducerShape::Max:
+            out.append(fieldName, jsMinMax(numbers, true));
+            break;
+        default:
+            return false;
+    }
+
+    return true;
+}
+
+// Recognizing the source isn't quite enough: a script can
+// replace Array.sum or Math.min with something else
+// entirely, or anything those shapes call on the way
+// (Function.prototype.apply, Array.prototype.map, a
+// MyType's toNumber).  The job checks, once, before
+// trusting the shape, that every builtin the shape relies
+// on is still the function the scope installed.
+// isPristineBuiltin is elided; it compares against the
+// function objects the scope captured right after
+// installing the prelude.
+namespace {
+
+const char* const kSumBuiltins[] = {"Array.sum"};
+const char* const kMinBuiltins[] = {"Math.min",
+                                    "Function.prototype.apply"};
+const char* const kMaxBuiltins[] = {"Math.max",
+                                    "Function.prototype.apply"};
+// Both MyType flavours, since emitted NumberLongs may come
+// in as either
+const char* const kSumMyTypeBuiltins[] = {
+    "Array.sum",
+    "Array.prototype.map",
+    "MyType.prototype.toNumber",
+    "BSONMyType.prototype.toNumber",
+};
+
+template <size_t N>
+bool allPristine(ImplScope& scope, const char* const (&paths)[N]) {
+    for (auto path : paths) {
+        if (!scope.isPristineBuiltin(path))
+            return false;
+    }
+    return true;
+}
+
+}  // namespace
+
+ReducerShape recognizeReducer(ImplScope& scope,
+                              const std::string& source) {
+    auto shape = ReducerFingerprint::recognize(source);
+
+    bool pristine = true;
+
+    switch (shape) {
+        case ReducerShape::Sum:
+            pristine = allPristine(scope, kSumBuiltins);
+            break;
+        case ReducerShape::SumMyType:
+            pristine = allPristine(scope, kSumMyTypeBuiltins);
+            break;
+        case ReducerShape::Min:
+            pristine = allPristine(scope, kMinBuiltins);
+            break;
+        case ReducerShape::Max:
+            pristine = allPristine(scope, kMaxBuiltins);
+            break;
+        default:
+            break;
+    }
+
+    return pristine ? shape : ReducerShape::None;
+}
+
+// A 10M emit job: 1000 keys, 10K values each, reduced with
+// Array.sum.  Once through the JS reduce function, once
+// through the native reducer.  jsReduce is the existing
+// path, which converts values to a JS array and calls the
+// function.
+void benchmarkReduce(
+    ImplScope& scope,
+    const std::string& reduceSource,
+    const std::vector<std::vector<BSONElement>>& valuesByKey) {
+    using namespace std::chrono;
+
+    auto shape = recognizeReducer(scope, reduceSource);
+
+    auto run = [&](const char* label, bool native) {
+        auto start = steady_clock::now();
+        size_t fallbacks = 0;
+
+        for (const auto& values : valuesByKey) {
+            BSONObjBuilder out;
+
+            if (!native ||
+                !nativeReduce(shape, values, "value", out)) {
+                fallbacks += native;
+                jsReduce(scope, reduceSource, values, out);
+            }
+        }
+
+        auto elapsed = steady_clock::now() - start;
+
+        std::cout
+            << label << ": "
+            << duration_cast<milliseconds>(elapsed).count()
+            << " ms, " << fallbacks << " fallbacks\n";
+    };
+
+    run("js    ", false);
+    run("native", true);
+}
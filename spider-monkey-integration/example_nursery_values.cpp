@@ -0,0 +1,266 @@
+// Most MyType values never make it out of the loop that
+// created them.  Something like
+//
+//     var total = new MyType("0");
+//     for (...) total = total.add(new MyType(doc.count));
+//
+// creates two objects per iteration, and both are dead by
+// the next one.  That's the textbook case for a
+// generational collector: allocate in the nursery, and let
+// a cheap minor GC throw away everything that didn't
+// survive.
+//
+// Unfortunately, AdaptedMyTypeInfo never gets that
+// benefit.  SpiderMonkey won't nursery allocate an object
+// whose class has a finalizer, because minor GCs don't run
+// finalizers.  So every temporary MyType is a tenured
+// allocation that has to wait for a full GC and a sweep
+// before its memory comes back.
+//
+// The way out is to not need a finalizer at all.  An
+// int64_t fits comfortably in two reserved slots, and
+// values held in slots are the engine's to manage.  No
+// private, no finalizer, and the class becomes nursery
+// eligible.
+
+// We'd rather not find out from a profile that somebody
+// added a finalizer to a type we'd carefully made nursery
+// friendly, so WrapType exposes the rule as a constexpr
+// check.  Same member pointer reflection as everywhere
+// else.
+template <typename T>
+constexpr bool isNurseryEligible() {
+    return &T::finalize == &BaseInfo::finalize &&
+        !(T::classFlags & JSCLASS_HAS_PRIVATE);
+}
+
+// The slot backed flavour of MyType, and the one the scope
+// installs in the global under that name.  The scope still
+// installs AdaptedMyTypeInfo, as AdaptedMyType, for the
+// benchmarks that need a type with a finalizer.
+struct SlotMyTypeInfo : public BaseInfo {
+    enum Slots : uint32_t {
+        HighSlot = 0,
+        LowSlot,
+        SlotCount,
+    };
+
+    static void construct(JSContext* cx, JS::CallArgs args);
+
+    struct Functions {
+        DECLARE_JS_FUNCTION(add);
+        DECLARE_JS_FUNCTION(toString);
+        DECLARE_JS_FUNCTION(toNumber);
+    };
+
+    static const JSFunctionSpec methods[4];
+
+    static const char* const className;
+    static const unsigned classFlags =
+        JSCLASS_HAS_RESERVED_SLOTS(SlotCount);
+
+    // MyType has no mutators, so small values can be
+    // shared.  See example_interned_values.cpp.
+    static const bool interned = true;
+    static const int64_t internMin = -1;
+    static const int64_t internMax = 1024;
+
+    // Clones as its 8 bytes.  See
+    // example_structured_clone.cpp.
+    static const uint32_t cloneTag = kMyTypeCloneTag;
+    static void writeClone(JSContext* cx,
+                           JSStructuredCloneWriter* writer,
+                           JS::HandleObject obj,
+                           CloneBuffer& clone);
+    static void readClone(JSContext* cx,
+                          JSStructuredCloneReader* reader,
+                          CloneBuffer& clone,
+                          JS::MutableHandleValue out);
+
+    // Prints as MyType("123").  See
+    // example_native_printing.cpp.
+    static void print(JSContext* cx,
+                      JS::HandleObject obj,
+                      OutputBuffer& out);
+
+    static int64_t getValue(JSObject* obj);
+    static void setValue(JSObject* obj, int64_t value);
+
+    // Get a MyType holding value, without going through the
+    // script visible constructor.  Small values come from
+    // the scope's intern cache.
+    static void make(JSContext* cx,
+                     int64_t value,
+                     JS::MutableHandleValue out);
+
+    // Always allocate a fresh object
+    static void makeUncached(JSContext* cx,
+                             int64_t value,
+                             JS::MutableHandleObject out);
+};
+
+static_assert(isNurseryEligible<SlotMyTypeInfo>(),
+              "SlotMyTypeInfo must stay nursery allocatable");
+
+const JSFunctionSpec SlotMyTypeInfo::methods[4] = {
+    ATTACH_JS_CONSTRAINED_METHOD_NO_PROTO(add,
+                                          SlotMyTypeInfo),
+    ATTACH_JS_CONSTRAINED_METHOD_NO_PROTO(toNumber,
+                                          SlotMyTypeInfo),
+    ATTACH_JS_CONSTRAINED_METHOD_NO_PROTO(toString,
+                                          SlotMyTypeInfo),
+    JS_FS_END,
+};
+
+const char* const SlotMyTypeInfo::className = "MyType";
+
+// Int32 values are stored inline in the slot, so splitting
+// the value in two keeps every bit without allocating.
+int64_t SlotMyTypeInfo::getValue(JSObject* obj) {
+    auto high = static_cast<uint32_t>(
+        JS_GetReservedSlot(obj, HighSlot).toInt32());
+    auto low = static_cast<uint32_t>(
+        JS_GetReservedSlot(obj, LowSlot).toInt32());
+
+    return static_cast<int64_t>(
+        (static_cast<uint64_t>(high) << 32) | low);
+}
+
+void SlotMyTypeInfo::setValue(JSObject* obj, int64_t value) {
+    auto bits = static_cast<uint64_t>(value);
+
+    JS_SetReservedSlot(
+        obj,
+        HighSlot,
+        JS::Int32Value(static_cast<int32_t>(bits >> 32)));
+    JS_SetReservedSlot(
+        obj, LowSlot, JS::Int32Value(static_cast<int32_t>(bits)));
+}
+
+void SlotMyTypeInfo::make(JSContext* cx,
+                          int64_t value,
+                          JS::MutableHandleValue out) {
+    JS::RootedObject obj(cx);
+    ImplScope::fromContext(cx)
+        .getInternCache<SlotMyTypeInfo>()
+        .get(cx, value, &obj);
+
+    out.setObject(*obj);
+}
+
+void SlotMyTypeInfo::makeUncached(JSContext* cx,
+                                  int64_t value,
+                                  JS::MutableHandleObject out) {
+    ImplScope::fromContext(cx)
+        .getProto<SlotMyTypeInfo>()
+        .newObject(out);
+
+    if (!out)
+        throw std::runtime_error("failed to allocate MyType");
+
+    setValue(out, value);
+}
+
+void SlotMyTypeInfo::construct(JSContext* cx,
+                               JS::CallArgs args) {
+    if (args.length() != 1) {
+        throw std::runtime_error(
+            "MyType takes exactly one argument");
+    }
+
+    int64_t value;
+
+    if (args.get(0).isString()) {
+        // Parsed in place.  See example_string_views.cpp.
+        StringArg str(cx, args.get(0));
+        value = str.visit(
+            [](auto chars) { return parseInt64(chars); });
+    } else if (args.get(0).isNumber()) {
+        // Casting anything outside [-2^63, 2^63) is
+        // undefined, NaN and the infinities included
+        double number = args.get(0).toNumber();
+        if (!(number >= -9223372036854775808.0 &&
+              number < 9223372036854775808.0)) {
+            throw std::range_error(
+                "MyType value out of range");
+        }
+        value = static_cast<int64_t>(number);
+    } else {
+        throw std::runtime_error(
+            "MyType takes a string or a number");
+    }
+
+    make(cx, value, args.rval());
+}
+
+// The argument may be either flavour of MyType.  See
+// example_bson_backed_values.cpp.
+void SlotMyTypeInfo::Functions::add::call(JSContext* cx,
+                                          JS::CallArgs args) {
+    addMyTypes(cx, getValue(&args.thisv().toObject()), args);
+}
+
+void SlotMyTypeInfo::Functions::toNumber::call(
+    JSContext* cx, JS::CallArgs args) {
+    args.rval().setNumber(static_cast<double>(
+        getValue(&args.thisv().toObject())));
+}
+
+void SlotMyTypeInfo::Functions::toString::call(
+    JSContext* cx, JS::CallArgs args) {
+    auto str =
+        std::to_string(getValue(&args.thisv().toObject()));
+
+    JS::RootedString rstr(cx,
+                          JS_NewStringCopyZ(cx, str.c_str()));
+    if (!rstr)
+        throw std::runtime_error("failed to allocate");
+
+    args.rval().setString(rstr);
+}
+
+// The proof is in the GC counters.  Run with AdaptedMyType
+// in place of MyType, this loop drives a steady stream of
+// major GCs; with SlotMyTypeInfo it should be all minor
+// GCs, and the major count from gcStats() shouldn't move.
+const char* const kTemporariesScript =
+    "var one = new MyType(1);\n"
+    "var total = new MyType(0);\n"
+    "for (var i = 0; i < 100 * 1000 * 1000; i++) {\n"
+    "    total = total.add(one);\n"
+    "}\n";
+
+void benchmarkTemporaries(ImplScope& scope) {
+    using namespace std::chrono;
+
+    JSRuntime* rt = JS_GetRuntime(scope.getContext());
+
+    auto minorBefore =
+        JS_GetGCParameter(rt, JSGC_MINOR_GC_NUMBER);
+    auto majorBefore =
+        JS_GetGCParameter(rt, JSGC_MAJOR_GC_NUMBER);
+    auto before = scope.getGCReport();
+    auto start = steady_clock::now();
+
+    scope.exec(kTemporariesScript);
+
+    auto elapsed = steady_clock::now() - start;
+    auto after = scope.getGCReport();
+
+    std::cout
+        << "wall:      "
+        << duration_cast<milliseconds>(elapsed).count()
+        << " ms\n"
+        << "minor GCs: "
+        << JS_GetGCParameter(rt, JSGC_MINOR_GC_NUMBER) -
+            minorBefore
+        << "\n"
+        << "major GCs: "
+        << JS_GetGCParameter(rt, JSGC_MAJOR_GC_NUMBER) -
+            majorBefore
+        << "\n"
+        << "pause:     "
+        << (after.gc.totalPauseNanos -
+            before.gc.totalPauseNanos) / 1e6
+        << " ms\n";
+}
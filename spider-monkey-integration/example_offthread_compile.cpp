@@ -0,0 +1,293 @@
+// Loading a big user script means parsing it, and parsing
+// megabytes of JavaScript takes long enough to notice.
+// While exec is in the parser, the scope's thread does
+// nothing else: the REPL doesn't respond, async natives
+// don't get their completions delivered, and a second
+// script waits for the first to finish parsing before its
+// own parse starts.
+//
+// SpiderMonkey can parse and emit bytecode on its own pool
+// of helper threads.  JS::CompileOffThread starts the work
+// and calls us back, on the helper thread, when it's done;
+// JS::FinishOffThreadScript then hands the script over to
+// the runtime, on the scope's thread.  We wrap that up as:
+//
+// - ImplScope::compileAsync(source, filename), which starts
+//   the compile and returns straight away,
+// - a PendingScript handle, which owns everything the
+//   helper thread reads until it's done with it (above all
+//   the UTF-16 copy of the source),
+// - PendingScript::wait, which keeps running the scope's
+//   event loop until the compile finishes, so callbacks
+//   keep being serviced while it waits.
+//
+// Starting several compiles before waiting on any of them
+// lets them parse in parallel, one per helper thread.
+
+class PendingScript {
+public:
+    PendingScript(PendingScript&&) = default;
+    PendingScript& operator=(PendingScript&&) = delete;
+
+    // A compile that nobody waited for still has to be
+    // finished, or the engine keeps its results forever.
+    // This only blocks: we may be unwinding, and running
+    // the event loop would run script callbacks.
+    ~PendingScript() {
+        if (!_state || _state->finished)
+            return;
+
+        void* token;
+        {
+            std::unique_lock<std::mutex> lk(_state->mutex);
+            _state->parsed.wait(lk, [&] {
+                return _state->token.load() != nullptr;
+            });
+            token = _state->token.load();
+        }
+
+        JSContext* cx = _scope->getContext();
+        JSAutoRequest ar(cx);
+        JSAutoCompartment ac(cx, _scope->getGlobal());
+
+        // Nobody wants the script, or its syntax error
+        JS::FinishOffThreadScript(cx, JS_GetRuntime(cx), token);
+        JS_ClearPendingException(cx);
+    }
+
+    // False for a moved-from handle
+    bool ready() const {
+        return _state &&
+            (_state->finished ||
+             _state->token.load(std::memory_order_acquire));
+    }
+
+    // Wait for the compile to finish, running the scope's
+    // event loop meanwhile, and return the script.  Throws
+    // if the script didn't compile.  Scope thread only.
+    void wait(JS::MutableHandleScript out);
+
+private:
+    friend class ImplScope;
+
+    // The helper thread reads source and writes token, and
+    // the callback it runs is handed a pointer to this, so
+    // it lives on the heap where moving the handle doesn't
+    // disturb it.
+    struct State {
+        explicit State(JSContext* cx) : script(cx) {}
+
+        std::unique_ptr<char16_t[], JS::FreePolicy> source;
+        size_t length = 0;
+        EventLoop* loop = nullptr;
+        std::atomic<void*> token{nullptr};
+
+        // For the destructor, which waits without the loop
+        std::mutex mutex;
+        std::condition_variable parsed;
+
+        bool finished = false;
+        JS::PersistentRootedScript script;
+    };
+
+    PendingScript(ImplScope* scope, std::unique_ptr<State> state)
+        : _scope(scope), _state(std::move(state)) {}
+
+    // The engine's callback, on a helper thread.  Nothing
+    // here may touch the runtime.
+    static void onParsed(void* token, void* data) {
+        auto state = static_cast<State*>(data);
+
+        // Once token is set a destructor may free state, so
+        // everything after the unlock uses only the loop,
+        // which the scope owns
+        auto loop = state->loop;
+        {
+            std::lock_guard<std::mutex> lk(state->mutex);
+            state->token.store(token, std::memory_order_release);
+            state->parsed.notify_all();
+        }
+        loop->wake();
+    }
+
+    ImplScope* _scope;
+    std::unique_ptr<State> _state;
+};
+
+PendingScript ImplScope::compileAsync(const std::string& source,
+                                      const std::string& filename) {
+    JSAutoRequest ar(_context);
+    JSAutoCompartment ac(_context, _global);
+
+    auto state = std::make_unique<PendingScript::State>(_context);
+
+    // The helper thread only takes UTF-16, and needs its own
+    // copy that outlives this call.
+    state->source.reset(JS::UTF8CharsToNewTwoByteCharsZ(
+                            _context,
+                            JS::UTF8Chars(source.data(),
+                                          source.size()),
+                            &state->length)
+                            .get());
+    if (!state->source)
+        throwCurrentJSException(_context,
+                                "failed to decode script source");
+
+    // The options are copied by CompileOffThread.  Not
+    // compileAndGo, for the same reason as the script cache:
+    // the script has to stay usable against our global once
+    // it's merged in from the helper's compartment.
+    JS::CompileOptions opts(_context);
+    opts.setFileAndLine(filename.c_str(), 1).setCompileAndGo(false);
+
+    // Small scripts, or a build without helper threads:
+    // compile right here and hand back a finished handle.
+    if (!JS::CanCompileOffThread(_context, opts, state->length)) {
+        if (!JS::Compile(_context,
+                         _global,
+                         opts,
+                         state->source.get(),
+                         state->length,
+                         &state->script)) {
+            throwCurrentJSException(_context, "compile failed");
+        }
+
+        state->finished = true;
+        state->source.reset();
+        return PendingScript(this, std::move(state));
+    }
+
+    state->loop = &_eventLoop;
+    if (!JS::CompileOffThread(_context,
+                              opts,
+                              state->source.get(),
+                              state->length,
+                              PendingScript::onParsed,
+                              state.get())) {
+        throwCurrentJSException(_context,
+                                "failed to start off thread compile");
+    }
+
+    return PendingScript(this, std::move(state));
+}
+
+void PendingScript::wait(JS::MutableHandleScript out) {
+    if (!_state)
+        throw std::logic_error(
+            "wait on a moved-from PendingScript");
+
+    JSContext* cx = _scope->getContext();
+
+    if (!_state->finished) {
+        _scope->getEventLoop().runUntil([&] {
+            return _state->token.load(std::memory_order_acquire) !=
+                nullptr;
+        });
+
+        // Finishing merges the helper's compartment into
+        // ours, and reports any syntax error as a pending
+        // exception on cx.
+        JSAutoRequest ar(cx);
+        JSAutoCompartment ac(cx, _scope->getGlobal());
+
+        _state->finished = true;
+        _state->script = JS::FinishOffThreadScript(
+            cx, JS_GetRuntime(cx), _state->token.load());
+        _state->source.reset();
+
+        if (!_state->script)
+            throwCurrentJSException(cx, "compile failed");
+    }
+
+    out.set(_state->script);
+}
+
+// A generated library of plain function declarations, about
+// size bytes of it
+std::string generateScript(size_t index, size_t size) {
+    std::string out;
+    out.reserve(size + 256);
+
+    for (size_t i = 0; out.size() < size; i++) {
+        out += "function f" + std::to_string(index) + "_" +
+            std::to_string(i) +
+            "(a, b) {\n"
+            "    var r = [];\n"
+            "    for (var k = 0; k < a.length; k++)\n"
+            "        r.push({ key: a[k], value: b ? b[k] : null });\n"
+            "    return r;\n"
+            "}\n";
+    }
+
+    return out;
+}
+
+// Load 10MB of scripts, split into count files, both ways.
+// Total time is when the last script has run.  The number
+// that matters for responsiveness is the longest stretch
+// the scope's thread spent in a single call, since that's
+// how long the REPL and every pending callback sat waiting.
+void benchmarkAsyncLoad(ImplScope& scope, size_t count) {
+    using namespace std::chrono;
+
+    const size_t kTotal = 10 * 1024 * 1024;
+
+    std::vector<std::string> scripts;
+    for (size_t i = 0; i < count; i++)
+        scripts.push_back(generateScript(i, kTotal / count));
+
+    JSContext* cx = scope.getContext();
+    JSAutoRequest ar(cx);
+    JSAutoCompartment ac(cx, scope.getGlobal());
+
+    JS::RootedValue rval(cx);
+    JS::RootedScript script(cx);
+    JS::RootedObject global(cx, scope.getGlobal());
+
+    steady_clock::duration longest{};
+    auto timed = [&](auto&& fn) {
+        auto start = steady_clock::now();
+        fn();
+        longest = std::max(longest, steady_clock::now() - start);
+    };
+
+    auto report = [&](const char* label,
+                      steady_clock::time_point start) {
+        std::cout
+            << label << ": "
+            << duration_cast<milliseconds>(
+                   steady_clock::now() - start)
+                   .count()
+            << " ms total, longest block "
+            << duration_cast<milliseconds>(longest).count()
+            << " ms\n";
+    };
+
+    auto start = steady_clock::now();
+    for (const auto& source : scripts)
+        timed([&] { scope.exec(source, &rval); });
+    report("exec        ", start);
+
+    longest = {};
+    start = steady_clock::now();
+
+    std::vector<PendingScript> pending;
+    for (size_t i = 0; i < count; i++) {
+        timed([&] {
+            pending.push_back(scope.compileAsync(
+                scripts[i], "script" + std::to_string(i) + ".js"));
+        });
+    }
+
+    // Run them in order, as exec would have.  Time spent
+    // inside wait's event loop is the thread being available,
+    // not blocked, so only finishing and running count.
+    for (auto& p : pending) {
+        p.wait(&script);
+        timed([&] {
+            if (!JS_ExecuteScript(cx, global, script, &rval))
+                throwCurrentJSException(cx, "script failed");
+        });
+    }
+    report("compileAsync", start);
+}
@@ -0,0 +1,251 @@
+// print and the REPL's echo of each result both end in a
+// write to stdout, one per line.  Printing a million-line
+// result set is then a million write calls.  Pointed at a
+// terminal that's fine: somebody is reading along, and
+// every line should show up as soon as it's printed.
+// Pointed at a file or a pipe it's a million syscalls to
+// move a few megabytes.
+//
+// So each scope gets an output sink: an OutputBuffer (see
+// example_native_printing.cpp) in front of a file
+// descriptor, with a policy for when to empty it:
+//
+// - when it's past a size,
+// - after every line, but only if the descriptor is a
+//   terminal,
+// - always before the REPL shows a prompt, or anything
+//   else waits on the user.
+//
+// Flushes made by the policy write whole lines only, and
+// keep a partial line in the buffer for the next one.  Every
+// scope on a thread has its own sink, and several may share
+// stdout, so a flush that cut a line in half would let
+// another scope's output land in the middle of it.  (A
+// single line longer than the capacity is written as it
+// is.)
+//
+// print and the echo write straight into the buffer, with
+// no std::string in between.  Anything that writes to the
+// same descriptor some other way (stderr shares the
+// terminal too) should flush the sink first, or the output
+// comes out of order.
+
+class OutputSink {
+public:
+    static constexpr size_t kDefaultCapacity = 64 * 1024;
+
+    // Line flushing if fd is a terminal
+    explicit OutputSink(int fd)
+        : OutputSink(fd, kDefaultCapacity, ::isatty(fd)) {}
+
+    // capacity 0 writes on every commit
+    OutputSink(int fd, size_t capacity, bool flushOnNewline)
+        : _fd(fd),
+          _capacity(capacity),
+          _flushOnNewline(flushOnNewline) {}
+
+    OutputSink(const OutputSink&) = delete;
+    OutputSink& operator=(const OutputSink&) = delete;
+
+    // Nothing to report errors to by now
+    ~OutputSink() {
+        try {
+            flush();
+        } catch (...) {
+        }
+    }
+
+    // Append to this, then commit()
+    OutputBuffer& buffer() {
+        return _buffer;
+    }
+
+    // Apply the flush policy to whatever was appended since
+    // the last commit
+    void commit() {
+        auto size = _buffer.size();
+        if (size >= _capacity ||
+            (_flushOnNewline && size &&
+             _buffer.data()[size - 1] == '\n')) {
+            std::string_view buffered(_buffer.data(), size);
+            auto end = buffered.rfind('\n');
+            write(end == std::string_view::npos ? size
+                                                : end + 1);
+        }
+    }
+
+    // Write out everything buffered
+    void flush() {
+        write(_buffer.size());
+    }
+
+private:
+    // Write out the first n bytes buffered.  On failure the
+    // buffered output is dropped, so that the next print
+    // doesn't fail again on the same bytes.
+    void write(size_t n);
+
+    const int _fd;
+    const size_t _capacity;
+    const bool _flushOnNewline;
+    OutputBuffer _buffer;
+};
+
+void OutputSink::write(size_t n) {
+    const char* data = _buffer.data();
+    size_t remaining = n;
+
+    while (remaining) {
+        auto written = ::write(_fd, data, remaining);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+
+            auto error = errno;
+            _buffer.clear();
+            throw std::system_error(
+                error, std::generic_category(), "write failed");
+        }
+
+        data += written;
+        remaining -= written;
+    }
+
+    _buffer.consume(n);
+}
+
+// A string's chars as UTF-8, unquoted
+void appendRaw(OutputBuffer& out, const StringArg& str) {
+    str.forEachCodePoint(
+        [&](uint32_t c) { out.appendCodePoint(c); });
+}
+
+// print(a, b, ...): the arguments separated by spaces, then
+// a newline.  Strings print as they are, everything else as
+// tojson would.
+struct PrintFunction {
+    static const char* name() {
+        return "print";
+    }
+
+    static void call(JSContext* cx, JS::CallArgs args) {
+        auto& scope = ImplScope::fromContext(cx);
+        auto& sink = scope.getOutputSink();
+        auto& out = sink.buffer();
+
+        NativePrinter printer(scope);
+
+        // A print that throws part way leaves nothing behind
+        auto start = out.size();
+        try {
+            for (unsigned i = 0; i < args.length(); i++) {
+                if (i)
+                    out.append(' ');
+
+                if (args.get(i).isString()) {
+                    appendRaw(out, StringArg(cx, args.get(i)));
+                } else {
+                    printer.print(args.get(i), out);
+                }
+            }
+        } catch (...) {
+            out.truncate(start);
+            throw;
+        }
+
+        out.append('\n');
+        sink.commit();
+
+        args.rval().setUndefined();
+    }
+};
+
+// Replacing the old print in the scope's free functions:
+//
+//     JS_FN("print", wrapFunction<PrintFunction>, 0, 0)
+
+// The REPL's half: echo a result, and flush before the
+// prompt.  undefined isn't echoed, as in any shell.
+void echoResult(ImplScope& scope, JS::HandleValue result) {
+    if (result.isUndefined())
+        return;
+
+    auto& sink = scope.getOutputSink();
+    auto& out = sink.buffer();
+
+    auto start = out.size();
+    try {
+        NativePrinter(scope).print(result, out);
+    } catch (...) {
+        out.truncate(start);
+        throw;
+    }
+
+    out.append('\n');
+    sink.commit();
+}
+
+void showPrompt(ImplScope& scope, const char* prompt) {
+    auto& sink = scope.getOutputSink();
+    sink.buffer().append(prompt);
+    sink.flush();
+}
+
+// A million lines, to a file and to a pipe, one write per
+// line (what we had) and buffered.  The pipe's reader just
+// drains it, so what's measured is our side.
+void benchmarkOutputSink(ImplScope& scope, const char* path) {
+    using namespace std::chrono;
+
+    const std::string kPrintLines =
+        "for (var i = 0; i < 1000000; i++) print(i);";
+
+    auto run = [&](const char* label, int fd, size_t capacity) {
+        auto previous = scope.setOutputSink(
+            std::make_unique<OutputSink>(fd, capacity, false));
+
+        auto start = steady_clock::now();
+        scope.exec(kPrintLines);
+        scope.getOutputSink().flush();
+        auto elapsed = steady_clock::now() - start;
+
+        scope.setOutputSink(std::move(previous));
+
+        std::cout << label << ": "
+                  << duration_cast<milliseconds>(elapsed).count()
+                  << " ms\n";
+    };
+
+    int file = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (file < 0)
+        throw std::system_error(
+            errno, std::generic_category(), "open failed");
+
+    run("file, per line", file, 0);
+
+    // Truncating leaves the offset where it was
+    if (::ftruncate(file, 0) != 0 ||
+        ::lseek(file, 0, SEEK_SET) != 0)
+        throw std::system_error(
+            errno, std::generic_category(), "truncate failed");
+    run("file, buffered", file, OutputSink::kDefaultCapacity);
+    ::close(file);
+
+    int fds[2];
+    if (::pipe(fds) != 0)
+        throw std::system_error(
+            errno, std::generic_category(), "pipe failed");
+
+    std::thread reader([fd = fds[0]] {
+        char buf[64 * 1024];
+        while (::read(fd, buf, sizeof(buf)) > 0) {
+        }
+    });
+
+    run("pipe, per line", fds[1], 0);
+    run("pipe, buffered", fds[1], OutputSink::kDefaultCapacity);
+
+    ::close(fds[1]);
+    reader.join();
+    ::close(fds[0]);
+}
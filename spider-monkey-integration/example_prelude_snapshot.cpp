@@ -0,0 +1,348 @@
+// Every shell starts by installing its prelude: the
+// helper libraries, written in JavaScript, that sit on top
+// of the types we install with WrapType.  That's a fair
+// amount of JavaScript, and every process parses and
+// compiles all of it, identically, before it can show a
+// prompt.
+//
+// The script cache (see example_script_cache.cpp) already
+// shows that XDR encoded bytecode decodes much faster than
+// source compiles.  For the prelude we can go one further
+// and do the encoding at build time:
+//
+// - A build step compiles the prelude and writes the
+//   encoded scripts to a versioned snapshot file that ships
+//   next to the binary.
+// - At startup the shell maps that file and decodes the
+//   scripts straight out of the mapping.  No read into a
+//   buffer, and no parse.
+// - XDR is only valid for the exact engine build that
+//   produced it, so the snapshot records the engine version
+//   and our own build id.  If either doesn't match, or the
+//   file is missing or damaged, we quietly install the
+//   prelude from source the way we always have.
+
+// The file layout: a fixed header, then one record per
+// prelude script, in install order.  Records are padded so
+// that each script's bytes start on an 8 byte boundary.
+struct SnapshotHeader {
+    static constexpr char kMagic[8] = {
+        'S', 'H', 'S', 'N', 'A', 'P', '\0', '\0'};
+    static constexpr uint32_t kFormatVersion = 1;
+
+    char magic[8];
+    uint32_t formatVersion;
+    uint32_t entryCount;
+
+    // JS_GetImplementationVersion() and kBuildId, both NUL
+    // padded
+    char engineVersion[64];
+    char buildId[64];
+};
+
+struct SnapshotEntry {
+    uint32_t nameLength;
+    uint32_t bytecodeLength;
+    // followed by the name, padding, then the bytecode
+};
+
+// The git hash (or equivalent) of this build, generated by
+// the build system
+extern const char kBuildId[];
+
+// Where the build installs the snapshot, next to the
+// binary.  ImplScope's constructor loads it from here
+// unless told otherwise.
+extern const char kPreludeSnapshotPath[];
+
+// The prelude's sources, generated from the .js files in
+// install order.  The same table the source path uses.
+struct PreludeFile {
+    const char* name;
+    const char* source;
+};
+extern const PreludeFile kPreludeFiles[];
+extern const size_t kPreludeFileCount;
+
+namespace {
+
+size_t padTo8(size_t n) {
+    return (n + 7) & ~size_t(7);
+}
+
+// A truncated id would never match at load time, and the
+// snapshot would be silently ignored, so an id that doesn't
+// fit fails the build instead
+void copyPadded(char* dest, size_t size, const char* src) {
+    if (std::strlen(src) >= size)
+        throw std::runtime_error(
+            std::string("snapshot id too long: ") + src);
+
+    std::memset(dest, 0, size);
+    std::memcpy(dest, src, std::strlen(src));
+}
+
+bool fieldMatches(const char* field,
+                  size_t size,
+                  const char* expected) {
+    return strnlen(field, size) < size &&
+        std::strcmp(field, expected) == 0;
+}
+
+}  // namespace
+
+// The build step.  The build runs a tiny tool linked
+// against the same engine as the shell, which calls this
+// with a freshly constructed scope.
+void writePreludeSnapshot(ImplScope& scope,
+                          const std::string& path) {
+    JSContext* cx = scope.getContext();
+    JSAutoRequest ar(cx);
+    JSAutoCompartment ac(cx, scope.getGlobal());
+
+    SnapshotHeader header{};
+    std::memcpy(header.magic,
+                SnapshotHeader::kMagic,
+                sizeof(header.magic));
+    header.formatVersion = SnapshotHeader::kFormatVersion;
+    header.entryCount = kPreludeFileCount;
+    copyPadded(header.engineVersion,
+               sizeof(header.engineVersion),
+               JS_GetImplementationVersion());
+    copyPadded(
+        header.buildId, sizeof(header.buildId), kBuildId);
+
+    // Write to a temporary and rename, so that a shell
+    // starting mid build never maps half a file
+    auto tmp = path + ".tmp";
+    std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char*>(&header),
+              sizeof(header));
+
+    const char zeros[8] = {};
+    JS::RootedScript script(cx);
+    JS::RootedObject global(cx, scope.getGlobal());
+
+    for (size_t i = 0; i < kPreludeFileCount; i++) {
+        const auto& file = kPreludeFiles[i];
+
+        // Not compileAndGo, so that the bytecode can be
+        // decoded against any global
+        JS::CompileOptions opts(cx);
+        opts.setFileAndLine(file.name, 1)
+            .setCompileAndGo(false);
+
+        if (!JS::Compile(cx,
+                         global,
+                         opts,
+                         file.source,
+                         std::strlen(file.source),
+                         &script)) {
+            throwCurrentJSException(
+                cx, std::string("failed to compile ") + file.name);
+        }
+
+        uint32_t length;
+        void* bytecode = JS_EncodeScript(cx, script, &length);
+        if (!bytecode)
+            throwCurrentJSException(
+                cx, std::string("failed to encode ") + file.name);
+
+        SnapshotEntry entry{
+            static_cast<uint32_t>(std::strlen(file.name)),
+            length};
+        auto nameBytes =
+            sizeof(entry) + entry.nameLength;
+
+        out.write(reinterpret_cast<const char*>(&entry),
+                  sizeof(entry));
+        out.write(file.name, entry.nameLength);
+        out.write(zeros, padTo8(nameBytes) - nameBytes);
+        out.write(static_cast<const char*>(bytecode), length);
+        out.write(zeros, padTo8(length) - length);
+
+        js_free(bytecode);
+    }
+
+    out.close();
+    if (!out || std::rename(tmp.c_str(), path.c_str()) != 0)
+        throw std::runtime_error(
+            "failed to write prelude snapshot " + path);
+}
+
+// A read only mapping of a whole file, unmapped on
+// destruction
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return;
+
+        if (::fstat(fd, &_stat) == 0 && _stat.st_size > 0) {
+            void* addr = ::mmap(nullptr,
+                                _stat.st_size,
+                                PROT_READ,
+                                MAP_PRIVATE,
+                                fd,
+                                0);
+            if (addr != MAP_FAILED) {
+                _data = static_cast<const char*>(addr);
+                _size = _stat.st_size;
+            }
+        }
+
+        ::close(fd);
+    }
+
+    ~MappedFile() {
+        if (_data)
+            ::munmap(const_cast<char*>(_data), _size);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const {
+        return _data;
+    }
+
+    size_t size() const {
+        return _size;
+    }
+
+    // What fstat said about the file we mapped
+    const struct stat& stat() const {
+        return _stat;
+    }
+
+private:
+    const char* _data = nullptr;
+    size_t _size = 0;
+    struct stat _stat {};
+};
+
+// Install the prelude from the snapshot.  Returns false,
+// having run nothing, if the snapshot can't be used; the
+// caller then installs from source.  Every offset is
+// checked against the file size before it's used, since a
+// truncated file is exactly the kind of thing we expect to
+// see after an interrupted install.
+bool installPreludeFromSnapshot(ImplScope& scope,
+                                const std::string& path) {
+    MappedFile file(path);
+    if (!file.data() || file.size() < sizeof(SnapshotHeader))
+        return false;
+
+    SnapshotHeader header;
+    std::memcpy(&header, file.data(), sizeof(header));
+
+    if (std::memcmp(header.magic,
+                    SnapshotHeader::kMagic,
+                    sizeof(header.magic)) != 0 ||
+        header.formatVersion !=
+            SnapshotHeader::kFormatVersion ||
+        header.entryCount != kPreludeFileCount ||
+        !fieldMatches(header.engineVersion,
+                      sizeof(header.engineVersion),
+                      JS_GetImplementationVersion()) ||
+        !fieldMatches(header.buildId,
+                      sizeof(header.buildId),
+                      kBuildId)) {
+        return false;
+    }
+
+    // Find every script before running any of them, so that
+    // a damaged file can't leave us with half a prelude.
+    std::vector<std::pair<const char*, uint32_t>> scripts;
+    size_t offset = sizeof(header);
+
+    for (uint32_t i = 0; i < header.entryCount; i++) {
+        SnapshotEntry entry;
+        if (file.size() - offset < sizeof(entry))
+            return false;
+        std::memcpy(&entry, file.data() + offset, sizeof(entry));
+
+        auto nameBytes = padTo8(sizeof(entry) + entry.nameLength);
+        auto scriptBytes = padTo8(entry.bytecodeLength);
+        if (file.size() - offset < nameBytes ||
+            file.size() - offset - nameBytes < scriptBytes)
+            return false;
+
+        scripts.emplace_back(file.data() + offset + nameBytes,
+                             entry.bytecodeLength);
+        offset += nameBytes + scriptBytes;
+    }
+
+    JSContext* cx = scope.getContext();
+    JSAutoRequest ar(cx);
+    JSAutoCompartment ac(cx, scope.getGlobal());
+
+    JS::RootedObject global(cx, scope.getGlobal());
+    JS::RootedScript script(cx);
+    JS::RootedValue rval(cx);
+
+    // Decode all of them first, for the same reason.
+    // Decoding copies into the engine's heap, so the mapping
+    // can go away as soon as we're done here.
+    JS::AutoObjectVector decoded(cx);
+    for (const auto& s : scripts) {
+        script = JS_DecodeScript(cx, s.first, s.second);
+        if (!script) {
+            JS_ClearPendingException(cx);
+            return false;
+        }
+        if (!decoded.append(JS_GetScriptObject(script)))
+            throw std::runtime_error("failed to allocate");
+    }
+
+    for (size_t i = 0; i < decoded.length(); i++) {
+        script = JS_GetObjectScript(decoded[i]);
+        if (!JS_ExecuteScript(cx, global, script, &rval)) {
+            throwCurrentJSException(
+                cx,
+                std::string("failed to run prelude ") +
+                    kPreludeFiles[i].name);
+        }
+    }
+
+    return true;
+}
+
+// Called from the ImplScope constructor, in place of
+// running the sources.  Returns whether the snapshot was
+// used.
+bool installPrelude(ImplScope& scope,
+                    const std::string& snapshotPath) {
+    if (installPreludeFromSnapshot(scope, snapshotPath))
+        return true;
+
+    for (size_t i = 0; i < kPreludeFileCount; i++)
+        scope.exec(kPreludeFiles[i].source);
+
+    return false;
+}
+
+// Time to prompt is really time to a constructed scope,
+// prelude and all, everything else at startup being the
+// same either way.  Run it once right after dropping the
+// page cache (cold) and again immediately after (warm),
+// with and without a snapshot present.
+void reportTimeToPrompt(JSRuntime* rt,
+                        const std::string& snapshotPath) {
+    using namespace std::chrono;
+
+    auto start = steady_clock::now();
+
+    ImplScope scope(rt, snapshotPath);
+
+    std::cout
+        << (scope.preludeFromSnapshot() ? "snapshot"
+                                        : "source  ")
+        << ": "
+        << duration_cast<microseconds>(
+               steady_clock::now() - start)
+                   .count() /
+            1000.0
+        << " ms to prompt\n";
+}
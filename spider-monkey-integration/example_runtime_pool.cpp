@@ -0,0 +1,405 @@
+// So far every scope has belonged to whichever thread asked
+// for it, and a server-side script request pays for a new
+// runtime, a new context, and installing every WrapType
+// before it gets to run a line of JavaScript.  For a
+// workload of many small $where evaluations that setup
+// dominates, and the threads doing it fight over cores
+// with everything else.
+//
+// Instead, let's own the threads.  A pool of N workers,
+// each pinned to a core, each owning one runtime and one
+// ImplScope for its whole life, with every WrapType
+// installed up front.  Work goes into per worker deques:
+// a worker takes its own newest task first (it's the one
+// most likely to have warm caches), and when it runs dry it
+// steals the oldest task from somebody else.
+//
+// SpiderMonkey runtimes are single threaded, so a task
+// can't carry JS values in or out.  Arguments and results
+// cross as BSON, and tasks get the worker's scope to do the
+// conversions in.
+
+// Per worker heap limit, as for any other shell runtime
+const uint32_t kMaxBytesBeforeGC = 256 * 1024 * 1024;
+
+class RuntimePool {
+public:
+    using Task = std::function<void(ImplScope&)>;
+
+    // Waits for every worker to set up its runtime and
+    // scope, and throws the first failure if any couldn't.
+    // A pool needs at least one worker.
+    explicit RuntimePool(size_t workers);
+    ~RuntimePool();
+
+    RuntimePool(const RuntimePool&) = delete;
+    RuntimePool& operator=(const RuntimePool&) = delete;
+
+    size_t size() const {
+        return _workers.size();
+    }
+
+    // Run f(scope) on some worker.  Exceptions thrown by f
+    // come out of the future.
+    template <typename F>
+    auto submit(F&& f)
+        -> std::future<decltype(f(std::declval<ImplScope&>()))>;
+
+    // The two common shapes of task.  Both return their
+    // result converted to BSON, as { result : <value> }.
+    std::future<BSONObj> eval(std::string source);
+    std::future<BSONObj> call(std::string functionSource,
+                              BSONObj args);
+
+private:
+    struct Worker {
+        std::thread thread;
+        std::mutex mutex;
+        std::deque<Task> tasks;
+
+        // Ready once the scope exists, or holding whatever
+        // stopped it from being made
+        std::promise<void> started;
+    };
+
+    void shutdown();
+    void push(Task task);
+    bool pop(size_t index, Task* out);
+    bool steal(size_t index, Task* out);
+    void run(size_t index);
+
+    std::vector<std::unique_ptr<Worker>> _workers;
+
+    // Round robin target for submissions from outside
+    std::atomic<size_t> _nextWorker{0};
+
+    // Idle workers sleep here rather than spin
+    std::atomic<size_t> _queued{0};
+    std::mutex _idleMutex;
+    std::condition_variable _idle;
+    bool _shutdown = false;
+};
+
+RuntimePool::RuntimePool(size_t workers) {
+    // push() spreads tasks with % workers
+    if (workers == 0)
+        throw std::invalid_argument(
+            "a RuntimePool needs at least one worker");
+
+    for (size_t i = 0; i < workers; i++)
+        _workers.push_back(std::make_unique<Worker>());
+
+    std::vector<std::future<void>> started;
+
+    // Start threads only once every deque exists, since any
+    // of them may try to steal from any other.
+    for (size_t i = 0; i < workers; i++) {
+        started.push_back(_workers[i]->started.get_future());
+        _workers[i]->thread =
+            std::thread([this, i] { run(i); });
+    }
+
+    // A pool missing a worker would quietly leave its deque
+    // to thieves, so one failure fails the pool
+    std::exception_ptr failure;
+    for (auto& future : started) {
+        try {
+            future.get();
+        } catch (...) {
+            if (!failure)
+                failure = std::current_exception();
+        }
+    }
+
+    if (failure) {
+        shutdown();
+        std::rethrow_exception(failure);
+    }
+}
+
+RuntimePool::~RuntimePool() {
+    shutdown();
+}
+
+void RuntimePool::shutdown() {
+    {
+        std::lock_guard<std::mutex> lk(_idleMutex);
+        _shutdown = true;
+    }
+    _idle.notify_all();
+
+    for (auto& worker : _workers)
+        worker->thread.join();
+}
+
+template <typename F>
+auto RuntimePool::submit(F&& f)
+    -> std::future<decltype(f(std::declval<ImplScope&>()))> {
+    using Result = decltype(f(std::declval<ImplScope&>()));
+
+    // std::function needs something copyable, and
+    // packaged_task isn't
+    auto task = std::make_shared<
+        std::packaged_task<Result(ImplScope&)>>(
+        std::forward<F>(f));
+    auto future = task->get_future();
+
+    push([task](ImplScope& scope) { (*task)(scope); });
+
+    return future;
+}
+
+void RuntimePool::push(Task task) {
+    auto index = _nextWorker.fetch_add(
+                     1, std::memory_order_relaxed) %
+        _workers.size();
+    auto& worker = *_workers[index];
+
+    // Count the task before it becomes visible, so that the
+    // worker that takes it never sees the count go below
+    // zero.  Taking the idle mutex, even briefly, closes the
+    // window between a worker deciding there's nothing to do
+    // and going to sleep.
+    {
+        std::lock_guard<std::mutex> lk(_idleMutex);
+        _queued.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    {
+        std::lock_guard<std::mutex> lk(worker.mutex);
+        worker.tasks.push_back(std::move(task));
+    }
+
+    _idle.notify_one();
+}
+
+// Owners work from the back of their own deque...
+bool RuntimePool::pop(size_t index, Task* out) {
+    auto& worker = *_workers[index];
+    std::lock_guard<std::mutex> lk(worker.mutex);
+
+    if (worker.tasks.empty())
+        return false;
+
+    *out = std::move(worker.tasks.back());
+    worker.tasks.pop_back();
+    return true;
+}
+
+// ...and thieves from the front of everyone else's,
+// starting with their neighbour so that they don't all pile
+// onto worker 0.
+bool RuntimePool::steal(size_t index, Task* out) {
+    for (size_t i = 1; i < _workers.size(); i++) {
+        auto& victim = *_workers[(index + i) % _workers.size()];
+        std::lock_guard<std::mutex> lk(victim.mutex);
+
+        if (!victim.tasks.empty()) {
+            *out = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void RuntimePool::run(size_t index) {
+    // Pinning is best effort; on a box with fewer cores than
+    // workers we just wrap around.  hardware_concurrency may
+    // not know, in which case we don't pin at all.
+    if (auto cores = std::thread::hardware_concurrency()) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(index % cores, &cpus);
+        pthread_setaffinity_np(
+            pthread_self(), sizeof(cpus), &cpus);
+    }
+
+    auto& worker = *_workers[index];
+
+    // The runtime and scope are created on, and never leave,
+    // this thread.  ImplScope installs every WrapType in its
+    // constructor.  Failures go back to the pool's
+    // constructor rather than escaping the thread.
+    JSRuntime* rt = JS_NewRuntime(kMaxBytesBeforeGC);
+    std::unique_ptr<ImplScope> ownedScope;
+
+    try {
+        if (!rt)
+            throw std::runtime_error("failed to create runtime");
+
+        ownedScope = std::make_unique<ImplScope>(rt);
+    } catch (...) {
+        if (rt)
+            JS_DestroyRuntime(rt);
+        worker.started.set_exception(std::current_exception());
+        return;
+    }
+
+    worker.started.set_value();
+
+    {
+        auto& scope = *ownedScope;
+        Task task;
+
+        for (;;) {
+            if (pop(index, &task) || steal(index, &task)) {
+                _queued.fetch_sub(1, std::memory_order_relaxed);
+                task(scope);
+                task = nullptr;
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lk(_idleMutex);
+            _idle.wait(lk, [&] {
+                return _shutdown ||
+                    _queued.load(std::memory_order_relaxed);
+            });
+
+            if (_shutdown &&
+                !_queued.load(std::memory_order_relaxed))
+                break;
+        }
+    }
+
+    ownedScope.reset();
+    JS_DestroyRuntime(rt);
+}
+
+// jsToBSON and bsonToJS are the same conversions the rest
+// of the integration uses; they're elided here.
+std::future<BSONObj> RuntimePool::eval(std::string source) {
+    return submit([source](ImplScope& scope) {
+        JSContext* cx = scope.getContext();
+        JSAutoRequest ar(cx);
+        JSAutoCompartment ac(cx, scope.getGlobal());
+
+        JS::RootedValue rval(cx);
+        scope.exec(source, &rval);
+
+        return jsToBSON(cx, "result", rval);
+    });
+}
+
+std::future<BSONObj> RuntimePool::call(
+    std::string functionSource, BSONObj args) {
+    return submit([functionSource, args](ImplScope& scope) {
+        JSContext* cx = scope.getContext();
+        JSAutoRequest ar(cx);
+        JSAutoCompartment ac(cx, scope.getGlobal());
+
+        // Recompiling per call is wasteful, but keeps the
+        // example short.
+        JS::RootedFunction fn(cx);
+        scope.compileFunction(functionSource, &fn);
+
+        // Values converted from the arguments (a NumberLong
+        // becomes a BSONMyType, say) point into a buffer
+        // they hold a reference on, so the arguments have
+        // to be in one.  Ours is dropped after the call; the
+        // wrappers keep their own.
+        std::unique_ptr<SharedBuffer, void (*)(SharedBuffer*)>
+            buffer(SharedBuffer::allocate(args.objsize()),
+                   [](SharedBuffer* b) { b->release(); });
+        std::memcpy(
+            buffer->data(), args.objdata(), args.objsize());
+        BSONObj shared(buffer->data());
+
+        JS::AutoValueVector argv(cx);
+        JS::RootedValue arg(cx);
+        for (const auto& elem : shared) {
+            bsonElementToJS(cx, buffer.get(), elem, &arg);
+            if (!argv.append(arg))
+                throw std::runtime_error("failed to allocate");
+        }
+
+        JS::RootedValue rval(cx);
+        if (!JS_CallFunction(
+                cx, JS::NullPtr(), fn, argv, &rval)) {
+            throwCurrentJSException(cx, "call failed");
+        }
+
+        return jsToBSON(cx, "result", rval);
+    });
+}
+
+// Scaling: evaluate the same small $where predicate over
+// the same documents with 1 to 32 workers.  Each task takes
+// a slice of documents so that the future and the queue
+// don't dominate.
+size_t countMatches(ImplScope& scope,
+                    const std::string& predicate,
+                    const std::vector<BSONObj>& batch,
+                    SharedBuffer* buffer) {
+    JSContext* cx = scope.getContext();
+    JSAutoRequest ar(cx);
+    JSAutoCompartment ac(cx, scope.getGlobal());
+
+    JS::RootedFunction fn(cx);
+    scope.compileFunction(predicate, &fn);
+
+    JS::RootedObject docs(cx);
+    JS::RootedObject results(cx);
+    scope.newArrayFromBatch(batch, buffer, &docs);
+    scope.invokeBatch(fn, docs, &results);
+
+    JS::RootedValue v(cx);
+    size_t matched = 0;
+
+    for (uint32_t i = 0; i < batch.size(); i++) {
+        if (!JS_GetElement(cx, results, i, &v))
+            throw std::runtime_error("failed to get result");
+        matched += JS::ToBoolean(v);
+    }
+
+    return matched;
+}
+
+void benchmarkPoolScaling(const std::vector<BSONObj>& docs,
+                          SharedBuffer* buffer) {
+    using namespace std::chrono;
+
+    const std::string predicate =
+        "function() { return this.status == 'A' && "
+        "this.qty > 10; }";
+    const size_t kSlice = 256;
+
+    double baseline = 0;
+
+    for (size_t workers : {1, 2, 4, 8, 16, 32}) {
+        RuntimePool pool(workers);
+        std::vector<std::future<size_t>> results;
+
+        auto start = steady_clock::now();
+
+        for (size_t i = 0; i < docs.size(); i += kSlice) {
+            auto end = std::min(i + kSlice, docs.size());
+
+            results.push_back(pool.submit([&, i, end](
+                                              ImplScope& scope) {
+                std::vector<BSONObj> batch(docs.begin() + i,
+                                           docs.begin() + end);
+                return countMatches(
+                    scope, predicate, batch, buffer);
+            }));
+        }
+
+        size_t matched = 0;
+        for (auto& result : results)
+            matched += result.get();
+
+        auto seconds = duration_cast<duration<double>>(
+                           steady_clock::now() - start)
+                           .count();
+        auto throughput = docs.size() / seconds;
+
+        if (workers == 1)
+            baseline = throughput;
+
+        std::cout << std::setw(2) << workers << " workers: "
+                  << static_cast<uint64_t>(throughput)
+                  << " docs/s, speedup "
+                  << throughput / baseline << "x\n";
+    }
+}
@@ -0,0 +1,450 @@
+// The same handful of sources get compiled over and over.
+// Every $where with the same predicate, every mapReduce
+// with the same reduce body, every REPL user pasting the
+// same helper: each one goes through the parser and the
+// bytecode emitter from scratch, in whichever context
+// happens to be running it.
+//
+// SpiderMonkey can serialize compiled scripts and functions
+// (XDR, via JS_EncodeScript and friends) and rebuild them
+// later without parsing, in any runtime.  That gives us a
+// process wide cache:
+//
+// - keyed by a hash of the source plus the compile options
+//   that affect the bytecode,
+// - holding the encoded bytes, which belong to no runtime
+//   and so can be shared by every scope in the process
+//   (including the RuntimePool workers),
+// - evicting least recently used entries once the whole
+//   thing goes over a byte budget,
+// - and never caching anything bigger than an eighth of
+//   that budget.  A one off 10 MB load isn't worth encoding
+//   and copying, and would push out every small hot entry.
+//
+// The hash only picks the bucket.  A collision that
+// returned the wrong bytecode would run the wrong code, so
+// every hit also compares the full source.
+
+enum class CompileKind : char {
+    Script = 0,
+    Function,
+};
+
+// Everything besides the source that changes what the
+// compiler produces.  Scripts are always compiled without
+// compileAndGo, which would tie their bytecode to the
+// global they were compiled against and make them
+// unencodable.
+struct CompileKey {
+    CompileKind kind;
+    std::string filename;
+    unsigned line;
+    JSVersion version;
+
+    bool operator==(const CompileKey& other) const {
+        return kind == other.kind &&
+            filename == other.filename &&
+            line == other.line && version == other.version;
+    }
+};
+
+// Compiles a function expression the way
+// ImplScope::compileFunction always has.  Elided.
+void compileFunctionExpression(JSContext* cx,
+                               const std::string& source,
+                               const CompileKey& key,
+                               JS::MutableHandleFunction out);
+
+class ScriptCache {
+public:
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+        uint64_t bytes = 0;
+        uint64_t compileNanosSaved = 0;
+    };
+
+    static ScriptCache& get() {
+        static ScriptCache cache(kDefaultBudget);
+        return cache;
+    }
+
+    explicit ScriptCache(size_t byteBudget)
+        : _budget(byteBudget) {}
+
+    // Compile source to a script, or decode it from the
+    // cache.  The result belongs to cx's runtime.
+    void compileScript(JSContext* cx,
+                       const std::string& source,
+                       const CompileKey& key,
+                       JS::MutableHandleScript out);
+
+    // Same for a function expression
+    void compileFunction(JSContext* cx,
+                         const std::string& source,
+                         const CompileKey& key,
+                         JS::MutableHandleFunction out);
+
+    Stats getStats() const {
+        std::lock_guard<std::mutex> lk(_mutex);
+        return _stats;
+    }
+
+private:
+    static constexpr size_t kDefaultBudget = 64 * 1024 * 1024;
+
+    // The most a single entry may take
+    size_t maxEntryBytes() const {
+        return _budget / 8;
+    }
+
+    struct Entry {
+        uint64_t hash;
+        std::string source;
+        CompileKey key;
+        std::vector<uint8_t> bytecode;
+        uint64_t compileNanos;
+
+        size_t size() const {
+            return source.size() + bytecode.size() +
+                key.filename.size() + sizeof(Entry);
+        }
+    };
+
+    using LRU = std::list<Entry>;
+
+    static uint64_t hash(const std::string& source,
+                         const CompileKey& key);
+
+    // Returns a copy of the bytecode on a hit, so that
+    // decoding happens outside the lock.  Updates recency.
+    bool lookup(uint64_t h,
+                const std::string& source,
+                const CompileKey& key,
+                std::vector<uint8_t>* bytecode,
+                uint64_t* compileNanos);
+
+    void insert(uint64_t h,
+                const std::string& source,
+                const CompileKey& key,
+                std::vector<uint8_t> bytecode,
+                uint64_t compileNanos);
+
+    void noteDecode(uint64_t compileNanos,
+                    uint64_t decodeNanos);
+
+    template <typename Compile, typename Encode, typename Decode>
+    void compileCached(JSContext* cx,
+                       const std::string& source,
+                       const CompileKey& key,
+                       Compile&& compile,
+                       Encode&& encode,
+                       Decode&& decode);
+
+    const size_t _budget;
+
+    mutable std::mutex _mutex;
+
+    // Most recently used at the front
+    LRU _lru;
+    std::unordered_multimap<uint64_t, LRU::iterator> _index;
+    Stats _stats;
+};
+
+// FNV-1a over the source and the options.  Not
+// cryptographic, and doesn't need to be: the full source
+// compare on lookup is what makes a hit safe.
+uint64_t ScriptCache::hash(const std::string& source,
+                           const CompileKey& key) {
+    uint64_t h = 14695981039346656037ull;
+
+    auto mix = [&](const void* data, size_t len) {
+        auto bytes = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < len; i++) {
+            h ^= bytes[i];
+            h *= 1099511628211ull;
+        }
+    };
+
+    mix(source.data(), source.size());
+    mix(&key.kind, sizeof(key.kind));
+    mix(key.filename.data(), key.filename.size());
+    mix(&key.line, sizeof(key.line));
+    mix(&key.version, sizeof(key.version));
+
+    return h;
+}
+
+bool ScriptCache::lookup(uint64_t h,
+                         const std::string& source,
+                         const CompileKey& key,
+                         std::vector<uint8_t>* bytecode,
+                         uint64_t* compileNanos) {
+    std::lock_guard<std::mutex> lk(_mutex);
+
+    auto range = _index.equal_range(h);
+    for (auto it = range.first; it != range.second; ++it) {
+        auto entry = it->second;
+
+        if (entry->key == key && entry->source == source) {
+            _lru.splice(_lru.begin(), _lru, entry);
+            *bytecode = entry->bytecode;
+            *compileNanos = entry->compileNanos;
+            _stats.hits++;
+            return true;
+        }
+    }
+
+    _stats.misses++;
+    return false;
+}
+
+void ScriptCache::insert(uint64_t h,
+                         const std::string& source,
+                         const CompileKey& key,
+                         std::vector<uint8_t> bytecode,
+                         uint64_t compileNanos) {
+    Entry entry{
+        h, source, key, std::move(bytecode), compileNanos};
+    if (entry.size() > maxEntryBytes())
+        return;
+
+    std::lock_guard<std::mutex> lk(_mutex);
+
+    // Another thread may have compiled the same thing while
+    // we were
+    auto range = _index.equal_range(h);
+    for (auto it = range.first; it != range.second; ++it) {
+        if (it->second->key == key &&
+            it->second->source == source)
+            return;
+    }
+
+    _lru.push_front(std::move(entry));
+    _index.emplace(h, _lru.begin());
+    _stats.bytes += _lru.front().size();
+
+    while (_stats.bytes > _budget && !_lru.empty()) {
+        auto& victim = _lru.back();
+
+        auto vrange = _index.equal_range(victim.hash);
+        for (auto it = vrange.first; it != vrange.second;
+             ++it) {
+            if (&*it->second == &victim) {
+                _index.erase(it);
+                break;
+            }
+        }
+
+        _stats.bytes -= victim.size();
+        _stats.evictions++;
+        _lru.pop_back();
+    }
+}
+
+void ScriptCache::noteDecode(uint64_t compileNanos,
+                             uint64_t decodeNanos) {
+    std::lock_guard<std::mutex> lk(_mutex);
+    if (compileNanos > decodeNanos)
+        _stats.compileNanosSaved += compileNanos - decodeNanos;
+}
+
+// The shared shape of both entry points: look up, decode on
+// a hit, otherwise compile, encode, and insert.  A decode
+// failure (the bytes came from an incompatible build, say)
+// isn't fatal; we just compile as if we'd missed.
+template <typename Compile, typename Encode, typename Decode>
+void ScriptCache::compileCached(JSContext* cx,
+                                const std::string& source,
+                                const CompileKey& key,
+                                Compile&& compile,
+                                Encode&& encode,
+                                Decode&& decode) {
+    using namespace std::chrono;
+
+    // Too big to ever be cached, so don't look it up, or
+    // pay for encoding it
+    if (source.size() > maxEntryBytes()) {
+        compile();
+        return;
+    }
+
+    auto h = hash(source, key);
+    std::vector<uint8_t> bytecode;
+    uint64_t compileNanos;
+
+    if (lookup(h, source, key, &bytecode, &compileNanos)) {
+        auto start = steady_clock::now();
+        if (decode(bytecode)) {
+            noteDecode(compileNanos,
+                       duration_cast<nanoseconds>(
+                           steady_clock::now() - start)
+                           .count());
+            return;
+        }
+        JS_ClearPendingException(cx);
+    }
+
+    auto start = steady_clock::now();
+    compile();
+    compileNanos = duration_cast<nanoseconds>(
+                       steady_clock::now() - start)
+                       .count();
+
+    // Encoding failures just mean this one isn't cached
+    uint32_t length;
+    void* data = encode(&length);
+    if (!data) {
+        JS_ClearPendingException(cx);
+        return;
+    }
+
+    auto bytes = static_cast<uint8_t*>(data);
+    insert(h,
+           source,
+           key,
+           std::vector<uint8_t>(bytes, bytes + length),
+           compileNanos);
+    js_free(data);
+}
+
+void ScriptCache::compileScript(JSContext* cx,
+                                const std::string& source,
+                                const CompileKey& key,
+                                JS::MutableHandleScript out) {
+    compileCached(
+        cx,
+        source,
+        key,
+        [&] {
+            JS::CompileOptions opts(cx, key.version);
+            opts.setFileAndLine(key.filename.c_str(), key.line)
+                .setCompileAndGo(false);
+
+            JS::RootedObject global(
+                cx, JS::CurrentGlobalOrNull(cx));
+            if (!JS::Compile(cx,
+                             global,
+                             opts,
+                             source.data(),
+                             source.size(),
+                             out)) {
+                throwCurrentJSException(cx, "compile failed");
+            }
+        },
+        [&](uint32_t* length) {
+            return JS_EncodeScript(cx, out, length);
+        },
+        [&](const std::vector<uint8_t>& bytes) {
+            out.set(JS_DecodeScript(
+                cx, bytes.data(), bytes.size()));
+            return out != nullptr;
+        });
+}
+
+void ScriptCache::compileFunction(
+    JSContext* cx,
+    const std::string& source,
+    const CompileKey& key,
+    JS::MutableHandleFunction out) {
+    compileCached(
+        cx,
+        source,
+        key,
+        [&] { compileFunctionExpression(cx, source, key, out); },
+        [&](uint32_t* length) {
+            JS::RootedObject funobj(cx,
+                                    JS_GetFunctionObject(out));
+            return JS_EncodeInterpretedFunction(
+                cx, funobj, length);
+        },
+        [&](const std::vector<uint8_t>& bytes) {
+            JSObject* funobj = JS_DecodeInterpretedFunction(
+                cx, bytes.data(), bytes.size());
+            out.set(funobj ? JS_GetObjectFunction(funobj)
+                           : nullptr);
+            return out != nullptr;
+        });
+}
+
+// ImplScope::compileFunction and exec now go through the
+// cache, so everything built on them (batched invocation,
+// the runtime pool, sharded map) benefits without changes.
+void ImplScope::compileFunction(const std::string& source,
+                                JS::MutableHandleFunction out) {
+    JSAutoRequest ar(_context);
+    JSAutoCompartment ac(_context, _global);
+
+    CompileKey key{CompileKind::Function,
+                   "(anonymous)",
+                   1,
+                   JS_GetVersion(_context)};
+    ScriptCache::get().compileFunction(
+        _context, source, key, out);
+}
+
+void ImplScope::exec(const std::string& source,
+                     JS::MutableHandleValue rval) {
+    JSAutoRequest ar(_context);
+    JSAutoCompartment ac(_context, _global);
+
+    CompileKey key{CompileKind::Script,
+                   "(shell)",
+                   1,
+                   JS_GetVersion(_context)};
+    JS::RootedScript script(_context);
+    ScriptCache::get().compileScript(
+        _context, source, key, &script);
+
+    if (!JS_ExecuteScript(_context, _global, script, rval))
+        throwCurrentJSException(_context, "exec failed");
+}
+
+void ImplScope::exec(const std::string& source) {
+    JS::RootedValue ignored(_context);
+    exec(source, &ignored);
+}
+
+
+// To measure, replay a log of the sources a real workload
+// compiled, in order, and compare against compiling every
+// one from scratch.
+void benchmarkReplay(ImplScope& scope,
+                     const std::vector<std::string>& replay) {
+    using namespace std::chrono;
+
+    JSContext* cx = scope.getContext();
+    JSAutoRequest ar(cx);
+    JSAutoCompartment ac(cx, scope.getGlobal());
+
+    auto& cache = ScriptCache::get();
+    auto before = cache.getStats();
+
+    CompileKey key{
+        CompileKind::Function, "(replay)", 1, JSVERSION_DEFAULT};
+    JS::RootedFunction fn(cx);
+
+    auto start = steady_clock::now();
+    for (const auto& source : replay)
+        cache.compileFunction(cx, source, key, &fn);
+    auto elapsed = steady_clock::now() - start;
+
+    auto after = cache.getStats();
+    auto hits = after.hits - before.hits;
+    auto lookups = hits + after.misses - before.misses;
+
+    std::cout
+        << "replayed " << replay.size() << " compiles in "
+        << duration_cast<milliseconds>(elapsed).count()
+        << " ms\n"
+        << "hit rate:   "
+        << (lookups ? 100.0 * hits / lookups : 0.0)
+        << "%\n"
+        << "time saved: "
+        << (after.compileNanosSaved -
+            before.compileNanosSaved) / 1e6
+        << " ms\n"
+        << "evictions:  " << after.evictions - before.evictions
+        << ", cache size " << after.bytes << " bytes\n";
+}
@@ -0,0 +1,242 @@
+// A $where that never returns, say
+//
+//     function() { while (true) {} }
+//
+// pins a core until somebody notices and kills the whole
+// process.  What we'd like instead is for each evaluation to
+// carry a deadline, and for the scope to stop the script
+// when it passes, leaving the context fit to run the next
+// one.
+//
+// SpiderMonkey gives us the mechanism.  JIT code and the
+// interpreter already check an interrupt flag at loop
+// headers and function entries, because they need to for
+// GC.  JS_RequestInterruptCallback sets that flag from any
+// thread, and the next check calls our interrupt callback,
+// which gets to decide whether the script carries on.  So a
+// script without a deadline pays nothing beyond checks the
+// engine makes anyway.
+//
+// The remaining pieces:
+//
+// - One watchdog thread for the whole process, sleeping
+//   until the earliest deadline across all scopes.  A
+//   thread per evaluation would cost more than most of the
+//   evaluations it guards.
+// - A flag on the scope that the watchdog sets and the
+//   interrupt callback reads.  Natives doing long loops of
+//   their own can poll the same flag.
+// - Cleanup that leaves no trace: a timeout mustn't leak
+//   into the next evaluation on the same context.
+
+// Thrown when an evaluation runs out of time, whether the
+// engine stopped it or a native noticed first
+class ScriptTimeout : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+class Watchdog {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // The deadline, and a per arm id to tell apart arms
+    // with the same deadline.  A key rather than an
+    // iterator, since the entry may be gone (fired) by the
+    // time the token comes back.
+    using Token = std::pair<Clock::time_point, uint64_t>;
+
+    // Deliberately leaked: the thread runs until the
+    // process exits, so the watchdog has to outlive static
+    // destruction.
+    static Watchdog& get() {
+        static Watchdog* watchdog = new Watchdog;
+        return *watchdog;
+    }
+
+    Token arm(ImplScope* scope, Clock::time_point deadline) {
+        std::lock_guard<std::mutex> lk(_mutex);
+        Token token(deadline, _nextId++);
+        auto it = _deadlines.emplace(token, scope).first;
+
+        // Only worth waking the thread if this is now the
+        // earliest deadline
+        if (it == _deadlines.begin())
+            _changed.notify_one();
+
+        return token;
+    }
+
+    // Once this returns, the watchdog won't fire for token.
+    // It may already have fired, which the caller finds out
+    // from the scope's flag, and its entry already gone.
+    void disarm(Token token) {
+        std::lock_guard<std::mutex> lk(_mutex);
+        _deadlines.erase(token);
+    }
+
+private:
+    Watchdog() : _thread([this] { run(); }) {
+        _thread.detach();
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lk(_mutex);
+
+        for (;;) {
+            if (_deadlines.empty()) {
+                _changed.wait(lk);
+                continue;
+            }
+
+            auto earliest = _deadlines.begin();
+            if (Clock::now() < earliest->first.first) {
+                _changed.wait_until(lk, earliest->first.first);
+                continue;
+            }
+
+            earliest->second->interruptForDeadline();
+            _deadlines.erase(earliest);
+        }
+    }
+
+    std::mutex _mutex;
+    std::condition_variable _changed;
+    std::map<Token, ImplScope*> _deadlines;
+    uint64_t _nextId = 0;
+    std::thread _thread;
+};
+
+// Called on the watchdog thread, with the watchdog's mutex
+// held, so the scope can't be disarming at the same time.
+void ImplScope::interruptForDeadline() {
+    _deadlineExceeded.store(true, std::memory_order_relaxed);
+    JS_RequestInterruptCallback(_runtime);
+}
+
+// Registered with JS_SetInterruptCallback when the scope is
+// built.  Returning false terminates the running script
+// with an uncatchable error: no pending exception, and no
+// finally blocks or catch clauses in the script get to run.
+bool ImplScope::interruptCallback(JSContext* cx) {
+    auto& scope = fromContext(cx);
+
+    // Other reasons for an interrupt, such as GC, land here
+    // too.  Those carry on as normal.
+    return !scope._deadlineExceeded.load(
+        std::memory_order_relaxed);
+}
+
+// What natives call from inside their own long running
+// loops.  A call and a single relaxed load, so it can go
+// in an inner loop:
+//
+//     for (auto& elem : hugeArray) {
+//         scope.checkDeadline();
+//         ...
+//     }
+//
+// The timeout propagates out through wrapFunction's
+// lippincott like any other exception.  The script can
+// catch that exception, but it'll be stopped for good at
+// its next interrupt check.
+void ImplScope::checkDeadline() const {
+    if (MOZ_UNLIKELY(_deadlineExceeded.load(
+            std::memory_order_relaxed))) {
+        throw ScriptTimeout("script exceeded its time limit");
+    }
+}
+
+// Bounds one evaluation.  The destructor is what makes the
+// context reusable: it disarms the watchdog, then clears
+// the flag and anything the terminated script left pending.
+// An interrupt the watchdog requested just before we
+// disarmed may still be outstanding in the runtime; when it
+// arrives the flag is already clear, so the next script
+// carries on untouched.
+class ScopedDeadline {
+public:
+    ScopedDeadline(ImplScope& scope,
+                   std::chrono::milliseconds limit)
+        : _scope(scope),
+          _token(Watchdog::get().arm(
+              &scope, Watchdog::Clock::now() + limit)) {}
+
+    ~ScopedDeadline() {
+        Watchdog::get().disarm(_token);
+        _scope.resetDeadline();
+    }
+
+    ScopedDeadline(const ScopedDeadline&) = delete;
+    ScopedDeadline& operator=(const ScopedDeadline&) = delete;
+
+private:
+    ImplScope& _scope;
+    Watchdog::Token _token;
+};
+
+void ImplScope::resetDeadline() {
+    _deadlineExceeded.store(false, std::memory_order_relaxed);
+    JS_ClearPendingException(_context);
+}
+
+// exec with a time limit.  A terminated script fails without
+// a pending exception, which is how we tell a timeout apart
+// from a script that threw.
+void ImplScope::exec(const std::string& source,
+                     std::chrono::milliseconds limit,
+                     JS::MutableHandleValue rval) {
+    ScopedDeadline deadline(*this, limit);
+
+    try {
+        exec(source, rval);
+    } catch (...) {
+        if (_deadlineExceeded.load(std::memory_order_relaxed))
+            throw ScriptTimeout(
+                "script exceeded its time limit of " +
+                std::to_string(limit.count()) + " ms");
+        throw;
+    }
+}
+
+// Checking both halves of the bargain.  The overhead run
+// times a tight loop with and without a generous deadline;
+// the two should be indistinguishable.  The kill run gives
+// an infinite loop 100ms, then reuses the context.
+void benchmarkDeadlines(ImplScope& scope) {
+    using namespace std::chrono;
+
+    const std::string loop =
+        "var x = 0;"
+        "for (var i = 0; i < 500 * 1000 * 1000; i++) x += i;";
+
+    JSContext* cx = scope.getContext();
+    JS::RootedValue rval(cx);
+
+    auto time = [&](const char* label, auto&& run) {
+        auto start = steady_clock::now();
+        run();
+        std::cout << label << ": "
+                  << duration_cast<milliseconds>(
+                         steady_clock::now() - start)
+                         .count()
+                  << " ms\n";
+    };
+
+    time("no deadline  ", [&] { scope.exec(loop, &rval); });
+    time("with deadline", [&] {
+        scope.exec(loop, minutes(10), &rval);
+    });
+
+    time("killed       ", [&] {
+        try {
+            scope.exec("while (true) {}", milliseconds(100), &rval);
+        } catch (const ScriptTimeout& ex) {
+            std::cout << ex.what() << "\n";
+        }
+    });
+
+    scope.exec("1 + 1", &rval);
+    std::cout << "context reused, 1 + 1 = "
+              << rval.toNumber() << "\n";
+}
@@ -0,0 +1,234 @@
+// mapReduce calls map once per document, and each call only
+// sees its own document (as this) and the emit function.
+// That makes the map phase embarrassingly parallel, except
+// that we've been running all of it, serially, in one
+// context.
+//
+// With a RuntimePool (see example_runtime_pool.cpp) we
+// already have K contexts on K threads, each with every
+// WrapType installed.  Sharding the map phase across them
+// is then mostly a matter of where emit puts things and how
+// the pieces are put back together:
+//
+// - Each shard is a contiguous run of the input.
+// - emit appends to a collector owned by the scope running
+//   the shard, so there's no sharing between threads while
+//   map runs.
+// - Shards are merged in input order.  The merged emit list
+//   is then exactly the list serial execution would have
+//   produced, so every key sees its values in the same
+//   order, and reduce (which needn't be associative for
+//   floating point) sees the same inputs.
+//
+// "Deterministic" here means a map function whose emits
+// depend only on the document.  One that keeps state in
+// globals across calls (counting documents, say) will see a
+// different slice of that state in each context, and won't
+// match serial execution.  We can't detect that, so
+// sharding is a mode the job asks for, not a default.
+
+// What emit collects into.  Keys and values are converted
+// to BSON as they're emitted, since nothing JS can leave
+// the worker's runtime.
+struct EmitCollector {
+    std::vector<std::pair<BSONObj, BSONObj>> emits;
+};
+
+// emit(key, value), installed as a free function on every
+// scope.  It writes to whatever collector the scope
+// currently has, and refuses to run without one.
+struct EmitFunction {
+    static const char* name() {
+        return "emit";
+    }
+
+    static void call(JSContext* cx, JS::CallArgs args) {
+        auto collector =
+            ImplScope::fromContext(cx).getEmitCollector();
+        if (!collector)
+            throw std::runtime_error(
+                "emit called outside of a map phase");
+
+        if (args.length() != 2)
+            throw std::runtime_error(
+                "emit takes exactly two arguments");
+
+        collector->emits.emplace_back(
+            jsToBSON(cx, "k", args.get(0)),
+            jsToBSON(cx, "v", args.get(1)));
+
+        args.rval().setUndefined();
+    }
+};
+
+// Point the scope's emit at collector for as long as this
+// is alive
+class ScopedEmitCollector {
+public:
+    ScopedEmitCollector(ImplScope& scope,
+                        EmitCollector* collector)
+        : _scope(scope) {
+        _scope.setEmitCollector(collector);
+    }
+
+    ~ScopedEmitCollector() {
+        _scope.setEmitCollector(nullptr);
+    }
+
+private:
+    ImplScope& _scope;
+};
+
+// Run map over one shard in the given scope.  The map
+// function is recompiled in each context, since compiled
+// functions belong to a runtime.
+EmitCollector runMapShard(ImplScope& scope,
+                          const std::string& mapSource,
+                          const std::vector<BSONObj>& shard,
+                          SharedBuffer* buffer) {
+    JSContext* cx = scope.getContext();
+    JSAutoRequest ar(cx);
+    JSAutoCompartment ac(cx, scope.getGlobal());
+
+    JS::RootedFunction map(cx);
+    scope.compileFunction(mapSource, &map);
+
+    JS::RootedObject docs(cx);
+    JS::RootedObject results(cx);
+    scope.newArrayFromBatch(shard, buffer, &docs);
+
+    EmitCollector collector;
+    ScopedEmitCollector scoped(scope, &collector);
+    scope.invokeBatch(map, docs, &results);
+
+    return collector;
+}
+
+// Emits grouped by key.  BSON keys compare with
+// woCompare, same as the serial path.
+using GroupedEmits =
+    std::map<BSONObj,
+             std::vector<BSONObj>,
+             SimpleBSONObjComparator::LessThan>;
+
+GroupedEmits groupEmits(
+    std::vector<EmitCollector>& shards) {
+    GroupedEmits grouped;
+
+    // Shards in input order, emits in emit order within
+    // each: the same sequence serial execution produces.
+    for (auto& shard : shards) {
+        for (auto& emit : shard.emits)
+            grouped[std::move(emit.first)].push_back(
+                std::move(emit.second));
+    }
+
+    return grouped;
+}
+
+// Split input into contiguous shards and map them across
+// the pool.  We make a few more shards than workers so that
+// a shard full of expensive documents doesn't leave the
+// other workers idle; stealing evens that out, and the
+// merge doesn't care which worker ran what.
+GroupedEmits shardedMap(RuntimePool& pool,
+                        const std::string& mapSource,
+                        const std::vector<BSONObj>& input,
+                        SharedBuffer* buffer) {
+    const size_t shardCount = pool.size() * 4;
+    const size_t shardSize =
+        (input.size() + shardCount - 1) / shardCount;
+
+    std::vector<std::future<EmitCollector>> futures;
+
+    for (size_t begin = 0; begin < input.size();
+         begin += shardSize) {
+        auto end = std::min(begin + shardSize, input.size());
+
+        futures.push_back(pool.submit(
+            [&, begin, end](ImplScope& scope) {
+                std::vector<BSONObj> shard(
+                    input.begin() + begin,
+                    input.begin() + end);
+                return runMapShard(
+                    scope, mapSource, shard, buffer);
+            }));
+    }
+
+    // get() in submission order, which is input order.  A
+    // map that throws fails the whole job, as it would have
+    // serially.
+    std::vector<EmitCollector> shards;
+    shards.reserve(futures.size());
+    for (auto& future : futures)
+        shards.push_back(future.get());
+
+    return groupEmits(shards);
+}
+
+// The serial path, for comparison: one scope, one shard.
+GroupedEmits serialMap(ImplScope& scope,
+                       const std::string& mapSource,
+                       const std::vector<BSONObj>& input,
+                       SharedBuffer* buffer) {
+    std::vector<EmitCollector> shards;
+    shards.push_back(
+        runMapShard(scope, mapSource, input, buffer));
+    return groupEmits(shards);
+}
+
+bool sameEmits(const GroupedEmits& a, const GroupedEmits& b) {
+    return std::equal(
+        a.begin(),
+        a.end(),
+        b.begin(),
+        b.end(),
+        [](const auto& x, const auto& y) {
+            return x.first.binaryEqual(y.first) &&
+                std::equal(x.second.begin(),
+                           x.second.end(),
+                           y.second.begin(),
+                           y.second.end(),
+                           [](const BSONObj& l,
+                              const BSONObj& r) {
+                               return l.binaryEqual(r);
+                           });
+        });
+}
+
+// Speedup versus K, checking every run against the serial
+// result.
+void benchmarkShardedMap(ImplScope& scope,
+                         const std::vector<BSONObj>& input,
+                         SharedBuffer* buffer) {
+    using namespace std::chrono;
+
+    const std::string map =
+        "function() { emit(this.customer, this.amount); }";
+
+    auto start = steady_clock::now();
+    auto expected = serialMap(scope, map, input, buffer);
+    auto serial = duration_cast<duration<double>>(
+                      steady_clock::now() - start)
+                      .count();
+
+    std::cout << "serial: " << serial * 1000 << " ms\n";
+
+    for (size_t k : {1, 2, 4, 8, 16, 32}) {
+        RuntimePool pool(k);
+
+        start = steady_clock::now();
+        auto grouped = shardedMap(pool, map, input, buffer);
+        auto elapsed = duration_cast<duration<double>>(
+                           steady_clock::now() - start)
+                           .count();
+
+        std::cout << "K=" << std::setw(2) << k << ": "
+                  << elapsed * 1000 << " ms, speedup "
+                  << serial / elapsed << "x, "
+                  << (sameEmits(expected, grouped)
+                          ? "matches serial"
+                          : "MISMATCH")
+                  << "\n";
+    }
+}
@@ -0,0 +1,241 @@
+// A native that wants a string argument has, so far, done
+// what construct does:
+//
+//     JSAutoByteString bstr(cx, args.get(0).toString());
+//     auto value = std::atoll(bstr.ptr());
+//
+// which mallocs a buffer and transcodes the whole string
+// into it, on every call, to read a few digits.
+//
+// The engine already has the chars.  Every string is
+// stored either as Latin1 (one byte per char, which covers
+// almost every string a script makes) or as UTF-16, and we
+// can look at either in place.  The catch is that the
+// chars can move: a GC may compact or collect the string.
+// So the view is only valid while no GC can happen, which
+// the engine lets us assert with JS::AutoCheckCannotGC.
+//
+// StringArg packages that up for natives:
+//
+//     StringArg str(cx, args.get(0));
+//     auto value = str.visit([](auto chars) {
+//         return parseInt64(chars);
+//     });
+//
+// While a StringArg is alive the native mustn't do anything
+// that can GC: allocate JS things, call back into JS, and
+// so on.  Debug builds of the engine assert on that.  Read
+// the chars, then let the StringArg go out of scope.
+
+class StringArg {
+public:
+    // value must be a string
+    StringArg(JSContext* cx, JS::HandleValue value)
+        : _str(cx, flatten(cx, value)) {
+        size_t length;
+
+        if (JS_StringHasLatin1Chars(_str)) {
+            auto chars = JS_GetLatin1StringCharsAndLength(
+                cx, _nogc, _str, &length);
+            _latin1 = std::string_view(
+                reinterpret_cast<const char*>(chars), length);
+            _isLatin1 = true;
+        } else {
+            auto chars = JS_GetTwoByteStringCharsAndLength(
+                cx, _nogc, _str, &length);
+            _twoByte = std::u16string_view(chars, length);
+        }
+    }
+
+    StringArg(const StringArg&) = delete;
+    StringArg& operator=(const StringArg&) = delete;
+
+    bool isLatin1() const {
+        return _isLatin1;
+    }
+
+    // Each char is a code point below 256.  Not UTF-8:
+    // anything past ASCII is a single byte here.
+    std::string_view latin1() const {
+        return _latin1;
+    }
+
+    std::u16string_view twoByte() const {
+        return _twoByte;
+    }
+
+    size_t length() const {
+        return _isLatin1 ? _latin1.size() : _twoByte.size();
+    }
+
+    // Call f with whichever view applies.  The way to write
+    // a parser once for both.
+    template <typename F>
+    decltype(auto) visit(F&& f) const {
+        return _isLatin1 ? f(_latin1) : f(_twoByte);
+    }
+
+    // Call f with each code point in turn.  Unpaired
+    // surrogates come out as U+FFFD.
+    template <typename F>
+    void forEachCodePoint(F&& f) const;
+
+    // A transcoded copy, for code that really wants UTF-8.
+    // This one allocates.
+    std::string toUTF8() const;
+
+private:
+    // The accessors want a linear string, and making one
+    // out of a rope allocates, so do it before _nogc.
+    static JSString* flatten(JSContext* cx,
+                             JS::HandleValue value) {
+        if (!value.isString())
+            throw std::runtime_error("expected a string");
+
+        JSFlatString* flat =
+            JS_FlattenString(cx, value.toString());
+        if (!flat)
+            throw std::runtime_error("failed to flatten string");
+        return JS_FORGET_STRING_FLATNESS(flat);
+    }
+
+    // In this order: the string is rooted, and flattened,
+    // before the no GC region starts.
+    JS::RootedString _str;
+    JS::AutoCheckCannotGC _nogc;
+
+    bool _isLatin1 = false;
+    std::string_view _latin1;
+    std::u16string_view _twoByte;
+};
+
+// Append code point cp to out as UTF-8
+inline void appendUTF8(std::string& out, uint32_t cp) {
+    if (cp < 0x80) {
+        out += static_cast<char>(cp);
+    } else if (cp < 0x800) {
+        out += static_cast<char>(0xC0 | (cp >> 6));
+        out += static_cast<char>(0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+        out += static_cast<char>(0xE0 | (cp >> 12));
+        out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (cp & 0x3F));
+    } else {
+        out += static_cast<char>(0xF0 | (cp >> 18));
+        out += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+        out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (cp & 0x3F));
+    }
+}
+
+template <typename F>
+void StringArg::forEachCodePoint(F&& f) const {
+    if (_isLatin1) {
+        for (unsigned char c : _latin1)
+            f(c);
+        return;
+    }
+
+    for (size_t i = 0; i < _twoByte.size(); i++) {
+        uint32_t c = _twoByte[i];
+
+        bool lead = c >= 0xD800 && c <= 0xDBFF;
+        bool trail = i + 1 < _twoByte.size() &&
+            _twoByte[i + 1] >= 0xDC00 && _twoByte[i + 1] <= 0xDFFF;
+
+        if (lead && trail) {
+            c = 0x10000 + ((c - 0xD800) << 10) +
+                (_twoByte[++i] - 0xDC00);
+        } else if (c >= 0xD800 && c <= 0xDFFF) {
+            c = 0xFFFD;
+        }
+
+        f(c);
+    }
+}
+
+std::string StringArg::toUTF8() const {
+    std::string out;
+    out.reserve(length());
+    forEachCodePoint([&](uint32_t c) { appendUTF8(out, c); });
+    return out;
+}
+
+// std::atoll over either view: leading whitespace, an
+// optional sign, then digits up to the first non digit.
+// Out of range values saturate at INT64_MIN or INT64_MAX,
+// as glibc's atoll (which is strtoll) does.
+template <typename CharT>
+int64_t parseInt64(std::basic_string_view<CharT> chars) {
+    size_t i = 0;
+    while (i < chars.size() &&
+           (chars[i] == ' ' ||
+            (chars[i] >= '\t' && chars[i] <= '\r')))
+        i++;
+
+    bool negative = false;
+    if (i < chars.size() && (chars[i] == '-' || chars[i] == '+'))
+        negative = chars[i++] == '-';
+
+    // The magnitude of INT64_MIN is one more than INT64_MAX's
+    const uint64_t limit =
+        uint64_t(std::numeric_limits<int64_t>::max()) + negative;
+
+    uint64_t value = 0;
+    for (; i < chars.size() && chars[i] >= '0' && chars[i] <= '9';
+         i++) {
+        uint64_t digit = chars[i] - '0';
+        if (value > (limit - digit) / 10) {
+            value = limit;
+            break;
+        }
+        value = value * 10 + digit;
+    }
+
+    return static_cast<int64_t>(negative ? 0 - value : value);
+}
+
+// The two ways of reading a number out of the same string,
+// a million times each.  The StringArg loop does no heap
+// allocation at all; the JSAutoByteString one does one per
+// iteration.
+void benchmarkStringArgs(ImplScope& scope) {
+    using namespace std::chrono;
+
+    JSContext* cx = scope.getContext();
+    JSAutoRequest ar(cx);
+    JSAutoCompartment ac(cx, scope.getGlobal());
+
+    JSString* digits = JS_NewStringCopyZ(cx, "9007199254740993");
+    if (!digits)
+        throw std::runtime_error("failed to allocate string");
+    JS::RootedValue arg(cx, JS::StringValue(digits));
+
+    const size_t kIterations = 1000 * 1000;
+    int64_t sum = 0;
+
+    auto time = [&](const char* label, auto&& parse) {
+        auto start = steady_clock::now();
+        for (size_t i = 0; i < kIterations; i++)
+            sum += parse();
+        std::cout << label << ": "
+                  << duration_cast<nanoseconds>(
+                         steady_clock::now() - start)
+                          .count() /
+                kIterations
+                  << " ns/call\n";
+    };
+
+    time("JSAutoByteString", [&] {
+        JSAutoByteString bstr(cx, arg.toString());
+        return std::atoll(bstr.ptr());
+    });
+
+    time("StringArg       ", [&] {
+        StringArg str(cx, arg);
+        return str.visit(
+            [](auto chars) { return parseInt64(chars); });
+    });
+
+    std::cout << "(checksum " << sum << ")\n";
+}
@@ -0,0 +1,382 @@
+// Getting a value from one context into another, whether
+// that's a RuntimePool worker or just a second scope, has so
+// far meant a detour through a string: toString on the way
+// out, the constructor (and a parse) on the way in.  For a
+// million MyTypes that's two million string conversions to
+// move eight million bytes.
+//
+// The engine's structured clone does this job for plain JS
+// values already, writing them to a flat buffer in one
+// context and rebuilding them from it in another.  For
+// objects it doesn't know it calls our hooks.  So each type
+// gets a say in how it's cloned, through its policy:
+//
+// - cloneTag, a number in the engine's range for user tags,
+//   marks the type as cloneable and identifies it in the
+//   buffer,
+// - writeClone writes the value in whatever binary form the
+//   type likes (MyType writes its 8 bytes),
+// - readClone builds a new object from that.
+//
+// Types backed by a SharedBuffer don't have to copy at all.
+// They write the buffer's address and take a reference to it
+// for the clone, and each read takes another for the new
+// object.  That only works within a process, which is the
+// only place our clones go.
+//
+// A clone can be read any number of times, into any number
+// of contexts, which is what fanning data out to a pool
+// wants.
+
+enum CloneTags : uint32_t {
+    kMyTypeCloneTag = JS_SCTAG_USER_MIN,
+    kBSONMyTypeCloneTag,
+};
+
+// The clone data and the buffer references it holds.  Also
+// the closure our hooks get, so that they can add to those.
+class CloneBuffer {
+public:
+    CloneBuffer() = default;
+
+    CloneBuffer(const CloneBuffer&) = delete;
+    CloneBuffer& operator=(const CloneBuffer&) = delete;
+
+    ~CloneBuffer() {
+        clear();
+    }
+
+    // Serialize v, replacing whatever this held
+    void write(JSContext* cx, JS::HandleValue v);
+
+    // Rebuild the value in cx's compartment.  Safe to call
+    // from several threads at once, one context each.
+    void read(JSContext* cx, JS::MutableHandleValue out) const;
+
+    // Keep buffer alive as long as this clone is
+    void hold(SharedBuffer* buffer) {
+        buffer->retain();
+        _held.push_back(buffer);
+    }
+
+    size_t size() const {
+        return _nbytes;
+    }
+
+private:
+    void clear();
+
+    uint64_t* _data = nullptr;
+    size_t _nbytes = 0;
+    std::vector<SharedBuffer*> _held;
+};
+
+namespace {
+
+// Objects carry a JSClass per scope, so whether obj is a T
+// is a question for the scope that made it.  The prototype
+// has the class too, but no value to write.  Types without
+// a cloneTag drop out at compile time.
+template <typename T>
+bool writeIfType(JSContext* cx,
+                 JSStructuredCloneWriter* writer,
+                 JS::HandleObject obj,
+                 CloneBuffer& clone) {
+    if constexpr (T::cloneTag == 0) {
+        return false;
+    } else {
+        static_assert(T::cloneTag >= JS_SCTAG_USER_MIN,
+                      "cloneTag must be in the user tag range");
+
+        auto& proto = ImplScope::fromContext(cx).getProto<T>();
+        if (JS_GetClass(obj) != proto.getJSClass())
+            return false;
+
+        if (obj == proto.getProto())
+            throw std::runtime_error(
+                std::string("can't clone the ") + T::className +
+                " prototype");
+
+        if (!JS_WriteUint32Pair(writer, T::cloneTag, 0))
+            throwCurrentJSException(cx, "clone write failed");
+
+        T::writeClone(cx, writer, obj, clone);
+        return true;
+    }
+}
+
+template <typename T>
+bool readIfType(JSContext* cx,
+                JSStructuredCloneReader* reader,
+                uint32_t tag,
+                CloneBuffer& clone,
+                JS::MutableHandleValue out) {
+    if constexpr (T::cloneTag == 0) {
+        return false;
+    } else {
+        if (tag != T::cloneTag)
+            return false;
+
+        T::readClone(cx, reader, clone, out);
+        return true;
+    }
+}
+
+template <typename... Ts>
+bool writeCloneable(JSContext* cx,
+                    JSStructuredCloneWriter* writer,
+                    JS::HandleObject obj,
+                    CloneBuffer& clone,
+                    ImplScope::TypeList<Ts...>) {
+    return (writeIfType<Ts>(cx, writer, obj, clone) || ...);
+}
+
+template <typename... Ts>
+bool readCloneable(JSContext* cx,
+                   JSStructuredCloneReader* reader,
+                   uint32_t tag,
+                   CloneBuffer& clone,
+                   JS::MutableHandleValue out,
+                   ImplScope::TypeList<Ts...>) {
+    return (readIfType<Ts>(cx, reader, tag, clone, out) || ...);
+}
+
+// The engine's hooks.  Same exception handling as the
+// other trampolines.
+bool writeOp(JSContext* cx,
+             JSStructuredCloneWriter* writer,
+             JS::HandleObject obj,
+             void* closure) {
+    try {
+        auto& clone = *static_cast<CloneBuffer*>(closure);
+        if (!writeCloneable(cx,
+                            writer,
+                            obj,
+                            clone,
+                            ImplScope::InstalledTypes()))
+            throw std::runtime_error(
+                std::string("can't clone a ") +
+                JS_GetClass(obj)->name);
+        return true;
+    } catch (...) {
+        cppToJSException(cx);
+        return false;
+    }
+}
+
+JSObject* readOp(JSContext* cx,
+                 JSStructuredCloneReader* reader,
+                 uint32_t tag,
+                 uint32_t,
+                 void* closure) {
+    try {
+        auto& clone = *static_cast<CloneBuffer*>(closure);
+        JS::RootedValue out(cx);
+        if (!readCloneable(cx,
+                           reader,
+                           tag,
+                           clone,
+                           &out,
+                           ImplScope::InstalledTypes()))
+            throw std::runtime_error("unknown clone tag " +
+                                     std::to_string(tag));
+        return &out.toObject();
+    } catch (...) {
+        cppToJSException(cx);
+        return nullptr;
+    }
+}
+
+void reportErrorOp(JSContext* cx, uint32_t errorid) {
+    JS_ReportError(cx, "structured clone failed (%u)", errorid);
+}
+
+const JSStructuredCloneCallbacks kCloneCallbacks = {
+    readOp,
+    writeOp,
+    reportErrorOp,
+    nullptr,
+    nullptr,
+    nullptr,
+};
+
+}  // namespace
+
+void CloneBuffer::write(JSContext* cx, JS::HandleValue v) {
+    clear();
+
+    if (!JS_WriteStructuredClone(cx,
+                                 v,
+                                 &_data,
+                                 &_nbytes,
+                                 &kCloneCallbacks,
+                                 this,
+                                 JS::UndefinedHandleValue)) {
+        clear();
+        throwCurrentJSException(cx, "failed to clone value");
+    }
+}
+
+// The read hooks only call hold() on the writing side, so a
+// const read can hand them this.
+void CloneBuffer::read(JSContext* cx,
+                       JS::MutableHandleValue out) const {
+    if (!JS_ReadStructuredClone(cx,
+                                _data,
+                                _nbytes,
+                                JS_STRUCTURED_CLONE_VERSION,
+                                out,
+                                &kCloneCallbacks,
+                                const_cast<CloneBuffer*>(this))) {
+        throwCurrentJSException(cx, "failed to read clone");
+    }
+}
+
+void CloneBuffer::clear() {
+    if (_data) {
+        JS_ClearStructuredClone(
+            _data, _nbytes, &kCloneCallbacks, this);
+        _data = nullptr;
+        _nbytes = 0;
+    }
+
+    for (auto buffer : _held)
+        buffer->release();
+    _held.clear();
+}
+
+// MyType: the value, little endian, as BSON has it
+void SlotMyTypeInfo::writeClone(JSContext* cx,
+                                JSStructuredCloneWriter* writer,
+                                JS::HandleObject obj,
+                                CloneBuffer&) {
+    uint64_t raw = htole64(static_cast<uint64_t>(getValue(obj)));
+    if (!JS_WriteBytes(writer, &raw, sizeof(raw)))
+        throwCurrentJSException(cx, "clone write failed");
+}
+
+void SlotMyTypeInfo::readClone(JSContext* cx,
+                               JSStructuredCloneReader* reader,
+                               CloneBuffer&,
+                               JS::MutableHandleValue out) {
+    char raw[8];
+    if (!JS_ReadBytes(reader, raw, sizeof(raw)))
+        throwCurrentJSException(cx, "clone read failed");
+
+    make(cx, readInt64LE(raw), out);
+}
+
+// BSONMyType: where the value lives.  The clone holds the
+// buffer, so the address stays good for as long as anyone
+// can read it.  Reads skip the identity map: a clone is a
+// new object, even in the scope it came from.
+void BSONMyTypeInfo::writeClone(JSContext* cx,
+                                JSStructuredCloneWriter* writer,
+                                JS::HandleObject obj,
+                                CloneBuffer& clone) {
+    auto buffer = static_cast<SharedBuffer*>(
+        JS_GetReservedSlot(obj, BufferSlot).toPrivate());
+    auto value = static_cast<const char*>(JS_GetPrivate(obj));
+
+    clone.hold(buffer);
+
+    uint64_t fields[2] = {
+        reinterpret_cast<uintptr_t>(buffer),
+        static_cast<uint64_t>(value - buffer->data()),
+    };
+    if (!JS_WriteBytes(writer, fields, sizeof(fields)))
+        throwCurrentJSException(cx, "clone write failed");
+}
+
+void BSONMyTypeInfo::readClone(JSContext* cx,
+                               JSStructuredCloneReader* reader,
+                               CloneBuffer&,
+                               JS::MutableHandleValue out) {
+    uint64_t fields[2];
+    if (!JS_ReadBytes(reader, fields, sizeof(fields)))
+        throwCurrentJSException(cx, "clone read failed");
+
+    auto buffer = reinterpret_cast<SharedBuffer*>(
+        static_cast<uintptr_t>(fields[0]));
+
+    JS::RootedObject obj(cx);
+    makeUncached(cx, buffer, buffer->data() + fields[1], &obj);
+    out.setObject(*obj);
+}
+
+// A million values from one scope to another, by clone and
+// by the old route through strings.  Both scopes on this
+// thread, so that only the conversion is being timed.
+void benchmarkClone(ImplScope& from, ImplScope& to) {
+    using namespace std::chrono;
+
+    const char* kMake =
+        "var values = [];"
+        "for (var i = 0; i < 1000000; i++)"
+        "    values.push(new MyType(String(i * 7919)));"
+        "values;";
+
+    JSContext* fromCx = from.getContext();
+    JSContext* toCx = to.getContext();
+
+    JSAutoRequest ar1(fromCx);
+    JSAutoRequest ar2(toCx);
+
+    auto time = [](const char* label, auto&& fn) {
+        auto start = steady_clock::now();
+        fn();
+        std::cout << label << ": "
+                  << duration_cast<milliseconds>(
+                         steady_clock::now() - start)
+                         .count()
+                  << " ms\n";
+    };
+
+    CloneBuffer clone;
+
+    {
+        JSAutoCompartment ac(fromCx, from.getGlobal());
+        JS::RootedValue values(fromCx);
+        from.exec(kMake, &values);
+
+        time("clone write     ",
+             [&] { clone.write(fromCx, values); });
+        std::cout << "clone size: " << clone.size() << " bytes\n";
+    }
+
+    {
+        JSAutoCompartment ac(toCx, to.getGlobal());
+        JS::RootedValue values(toCx);
+        time("clone read      ",
+             [&] { clone.read(toCx, &values); });
+    }
+
+    // The old way: strings out, strings in
+    CloneBuffer strings;
+    {
+        JSAutoCompartment ac(fromCx, from.getGlobal());
+        JS::RootedValue values(fromCx);
+        time("toString + write", [&] {
+            from.exec("values.map(function(v) {"
+                      "    return v.toString();"
+                      "})",
+                      &values);
+            strings.write(fromCx, values);
+        });
+    }
+
+    {
+        JSAutoCompartment ac(toCx, to.getGlobal());
+        JS::RootedValue values(toCx);
+        JS::RootedObject global(toCx, to.getGlobal());
+        time("read + construct", [&] {
+            strings.read(toCx, &values);
+            if (!JS_SetProperty(toCx, global, "strings", values))
+                throwCurrentJSException(toCx, "set failed");
+            to.exec("strings.map(function(s) {"
+                    "    return new MyType(s);"
+                    "})",
+                    &values);
+        });
+    }
+}
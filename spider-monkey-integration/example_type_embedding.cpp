@@ -437,6 +437,28 @@ struct BaseInfo {
 
     static const unsigned classFlags = 0;
 
+    // If finalize only frees memory (no engine calls, no
+    // touching the scope) it may run on the GC's background
+    // sweeping thread instead of inside the pause
+    static const bool finalizeInBackground = false;
+
+    // Immutable types may hand out one shared, frozen
+    // instance per value for a small range of values
+    // (internMin through internMax) instead of allocating
+    static const bool interned = false;
+
+    // Types wrapping a native by pointer may keep one
+    // wrapper per native per context, so that handing the
+    // same native over twice gives the same object
+    static const bool weakIdentity = false;
+
+    // Installed types (ImplScope::InstalledTypes) with a
+    // nonzero tag, JS_SCTAG_USER_MIN and up, can be
+    // structured cloned: writeClone writes the value, and
+    // readClone rebuilds it in whichever context reads the
+    // clone.  See example_structured_clone.cpp.
+    static const uint32_t cloneTag = 0;
+
     // A special hook to run after the type is installed
     // into the scope
     static void postInstall(JSContext* cx,
@@ -461,6 +483,22 @@ struct BaseInfo {
                           JS::HandleObject obj,
                           JS::AutoIdVector& properties);
     static void finalize(JSFreeOp* fop, JSObject* obj);
+
+    // How the shell prints the value, written straight into
+    // out.  Types without one go through the generic path.
+    // See example_native_printing.cpp.
+    static void print(JSContext* cx,
+                      JS::HandleObject obj,
+                      OutputBuffer& out);
+
+    static void writeClone(JSContext* cx,
+                           JSStructuredCloneWriter* writer,
+                           JS::HandleObject obj,
+                           CloneBuffer& clone);
+    static void readClone(JSContext* cx,
+                          JSStructuredCloneReader* reader,
+                          CloneBuffer& clone,
+                          JS::MutableHandleValue out);
     static void getProperty(JSContext* cx,
                             JS::HandleObject obj,
                             JS::HandleId id,
@@ -521,6 +559,10 @@ struct AdaptedMyTypeInfo : public BaseInfo {
 
     static const char* const className;
     static const unsigned classFlags = JSCLASS_HAS_PRIVATE;
+
+    // MyType is a plain int64_t, so freeing it is safe from
+    // any thread
+    static const bool finalizeInBackground = true;
 };
 
 // and an implementation of:
@@ -533,7 +575,9 @@ const JSFunctionSpec AdaptedMyTypeInfo::methods[3] = {
     JS_FS_END,
 };
 
-const char* const AdaptedMyTypeInfo::className = "MyType";
+// Not "MyType": the scope installs this next to the slot
+// backed MyType (see example_nursery_values.cpp)
+const char* const AdaptedMyTypeInfo::className = "AdaptedMyType";
 
 void AdaptedMyTypeInfo::construct(
     JSContext* cx, JS::CallArgs args) { /* ... */
@@ -553,6 +597,11 @@ void AdaptedMyTypeInfo::Functions::toNumber::call(
 
 template <typename T>
 class WrapType : public T {
+    // Compile time checks on the policy.  See
+    // example_background_finalize.cpp.
+    static_assert(sizeof(CheckFinalizePolicy<T>) > 0,
+                  "policy checks must be instantiated");
+
 public:
     WrapType(JSContext* context);
     ~WrapType();
@@ -573,6 +622,13 @@ public:
     const JSClass* getJSClass() const;
 
     JS::HandleObject getProto() const;
+
+    // Bookkeeping for GC telemetry.  Bumped from the
+    // finalize trampoline each time an instance of this
+    // type is swept.  Relaxed atomic, since that can happen
+    // on a background sweeping thread.
+    void noteFinalized();
+    uint64_t getFinalizedCount() const;
 };
 
 // Allowing us to create and install a new type by:
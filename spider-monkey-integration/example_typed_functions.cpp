@@ -0,0 +1,530 @@
+// Every T::call we've written starts the same way:
+//
+//     if (args.length() < 2)
+//         throw ...;
+//     if (!args.get(0).isString())
+//         throw ...;
+//     JSAutoByteString digits(cx, args.get(0).toString());
+//     double scale;
+//     if (!JS::ToNumber(cx, args.get(1), &scale))
+//         ...
+//
+// That's boilerplate, it's where the crashes come from
+// (toString() on something that turned out not to be a
+// string), and it tends to reach for the generic ToString
+// and ToNumber even when the value already has the type we
+// want.
+//
+// The C++ signature of the function we're exposing already
+// says everything the boilerplate does.  So:
+//
+//     struct Parse {
+//         static int64_t scaled(std::string_view digits,
+//                               double scale);
+//     };
+//
+//     JS_FN("parseScaled",
+//           wrapTypedFunction<&Parse::scaled>,
+//           typedArity<&Parse::scaled>,
+//           0)
+//
+// wrapTypedFunction deduces the parameter and return types,
+// checks the arity, converts each argument with a converter
+// picked at compile time for its type, and converts the
+// result back.  Each converter tries the case where the
+// value is already the right type first, and only falls
+// back to the engine's generic conversions when it isn't.
+//
+// A function may take JSContext* as its first parameter, if
+// it needs to make JS things.  Such a function can't take a
+// std::string_view: the view points at chars inside a JS
+// string, which only stay put as long as nothing can GC,
+// and with a context in hand anything can.
+
+// Missing arguments are an error; extra ones are ignored,
+// as they would be for a JS function.
+class ArgumentCountError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+template <typename Fn>
+struct FunctionTraits;
+
+template <typename R, typename... Args>
+struct FunctionTraits<R (*)(Args...)> {
+    using Return = R;
+    using Params = std::tuple<Args...>;
+    static constexpr size_t kParams = sizeof...(Args);
+};
+
+template <typename R, typename... Args>
+struct FunctionTraits<R (*)(Args...) noexcept>
+    : FunctionTraits<R (*)(Args...)> {};
+
+template <typename Traits>
+constexpr bool takesContext() {
+    if constexpr (Traits::kParams == 0) {
+        return false;
+    } else {
+        return std::is_same<
+            std::tuple_element_t<0, typename Traits::Params>,
+            JSContext*>::value;
+    }
+}
+
+// How many JS arguments fn takes, for JSFunctionSpec.nargs
+template <auto fn>
+constexpr uint16_t typedArity =
+    FunctionTraits<decltype(fn)>::kParams -
+    (takesContext<FunctionTraits<decltype(fn)>>() ? 1 : 0);
+
+// One converter per supported parameter type.  The
+// constructor does the conversion, and anything in it may
+// GC; get() hands back the result and mustn't.
+template <typename T>
+struct ArgConverter {
+    static_assert(sizeof(T) == 0,
+                  "no argument conversion for this type");
+};
+
+template <>
+struct ArgConverter<bool> {
+    ArgConverter(JSContext*, JS::HandleValue v)
+        : value(v.isBoolean() ? v.toBoolean()
+                              : JS::ToBoolean(v)) {}
+
+    bool get() const {
+        return value;
+    }
+
+    bool value;
+};
+
+template <>
+struct ArgConverter<double> {
+    ArgConverter(JSContext* cx, JS::HandleValue v) {
+        if (v.isNumber()) {
+            value = v.toNumber();
+        } else if (!JS::ToNumber(cx, v, &value)) {
+            throwCurrentJSException(cx, "expected a number");
+        }
+    }
+
+    double get() const {
+        return value;
+    }
+
+    double value;
+};
+
+template <>
+struct ArgConverter<int32_t> {
+    ArgConverter(JSContext* cx, JS::HandleValue v) {
+        if (v.isInt32()) {
+            value = v.toInt32();
+        } else if (!JS::ToInt32(cx, v, &value)) {
+            throwCurrentJSException(cx, "expected a number");
+        }
+    }
+
+    int32_t get() const {
+        return value;
+    }
+
+    int32_t value;
+};
+
+// Doubles have to be integral and in range.  Silently
+// truncating 1.5, or wrapping 2^64, would hide bugs.
+template <>
+struct ArgConverter<int64_t> {
+    ArgConverter(JSContext* cx, JS::HandleValue v) {
+        if (v.isInt32()) {
+            value = v.toInt32();
+            return;
+        }
+
+        double d;
+        if (v.isDouble()) {
+            d = v.toDouble();
+        } else if (!JS::ToNumber(cx, v, &d)) {
+            throwCurrentJSException(cx, "expected a number");
+        }
+
+        if (!(d >= -9223372036854775808.0 &&
+              d < 9223372036854775808.0) ||
+            d != std::trunc(d)) {
+            throw std::range_error(
+                "expected an integer in the int64 range");
+        }
+        value = static_cast<int64_t>(d);
+    }
+
+    int64_t get() const {
+        return value;
+    }
+
+    int64_t value;
+};
+
+// Non-strings go through JS::ToString, like String(v)
+inline JSString* argToString(JSContext* cx,
+                             JS::HandleValue v) {
+    JSString* str =
+        v.isString() ? v.toString() : JS::ToString(cx, v);
+    if (!str)
+        throwCurrentJSException(cx, "expected a string");
+    return str;
+}
+
+template <>
+struct ArgConverter<std::string> {
+    ArgConverter(JSContext* cx, JS::HandleValue v) {
+        JS::RootedValue str(cx,
+                            JS::StringValue(argToString(cx, v)));
+        value = StringArg(cx, str).toUTF8();
+    }
+
+    const std::string& get() const {
+        return value;
+    }
+
+    std::string value;
+};
+
+// UTF-8, like std::string.  A string that's pure ASCII,
+// which is most of them, is the one case where Latin1 and
+// UTF-8 agree, and there we hand out the engine's own chars.
+// Anything else gets transcoded into the converter.
+template <>
+struct ArgConverter<std::string_view> {
+    ArgConverter(JSContext* cx, JS::HandleValue v)
+        : str(cx, JS::StringValue(argToString(cx, v))) {
+        StringArg arg(cx, str);
+
+        bool ascii = arg.isLatin1() &&
+            std::all_of(arg.latin1().begin(),
+                        arg.latin1().end(),
+                        [](char c) {
+                            return static_cast<unsigned char>(c) <
+                                0x80;
+                        });
+
+        if (!ascii) {
+            transcoded = arg.toUTF8();
+            value = transcoded;
+            shared = false;
+        }
+    }
+
+    // Only now, with every converter constructed, do we
+    // take the pointer: nothing between here and the call
+    // can GC.
+    std::string_view get(JSContext* cx) {
+        if (shared) {
+            StringArg arg(cx, str);
+            value = arg.latin1();
+        }
+        return value;
+    }
+
+    JS::RootedValue str;
+    bool shared = true;
+    std::string transcoded;
+    std::string_view value;
+};
+
+// For functions that want the value as is
+template <>
+struct ArgConverter<JS::HandleValue> {
+    ArgConverter(JSContext*, JS::HandleValue v) : value(v) {}
+
+    JS::HandleValue get() const {
+        return value;
+    }
+
+    JS::HandleValue value;
+};
+
+// The converters for a call, one member per parameter.
+// Members, unlike the elements of a std::tuple, are
+// guaranteed to be constructed in order, so arguments are
+// converted left to right (valueOf and toString run in the
+// order a script would expect) and the Rooteds inside them
+// are destroyed in reverse.
+template <size_t I, typename... Params>
+struct Converters {
+    Converters(JSContext*, const JS::CallArgs&) {}
+};
+
+template <size_t I, typename Head, typename... Tail>
+struct Converters<I, Head, Tail...> {
+    Converters(JSContext* cx, const JS::CallArgs& args)
+        : head(cx, args.get(I)), tail(cx, args) {}
+
+    ArgConverter<std::decay_t<Head>> head;
+    Converters<I + 1, Tail...> tail;
+};
+
+template <size_t N, size_t I, typename... Params>
+auto& converterAt(Converters<I, Params...>& c) {
+    if constexpr (N == I) {
+        return c.head;
+    } else {
+        return converterAt<N>(c.tail);
+    }
+}
+
+template <typename Converter>
+decltype(auto) convertedValue(JSContext* cx, Converter& c) {
+    using ViewConverter = ArgConverter<std::string_view>;
+
+    if constexpr (std::is_same<Converter, ViewConverter>::value) {
+        return c.get(cx);
+    } else {
+        return c.get();
+    }
+}
+
+// Return values, the other way
+inline void returnValue(JSContext*,
+                        bool v,
+                        JS::MutableHandleValue out) {
+    out.setBoolean(v);
+}
+
+inline void returnValue(JSContext*,
+                        int32_t v,
+                        JS::MutableHandleValue out) {
+    out.setInt32(v);
+}
+
+inline void returnValue(JSContext*,
+                        double v,
+                        JS::MutableHandleValue out) {
+    out.setNumber(v);
+}
+
+// Only values a double holds exactly.  Anything else would
+// come back silently rounded, which is the trap MyType
+// exists to avoid, so this throws.  Natives that produce
+// values that large should return a MyType.
+inline void returnValue(JSContext*,
+                        int64_t v,
+                        JS::MutableHandleValue out) {
+    double d = static_cast<double>(v);
+
+    // d can round up to 2^63, which doesn't cast back
+    if (!(d < 9223372036854775808.0) ||
+        static_cast<int64_t>(d) != v) {
+        throw std::range_error(
+            std::to_string(v) + " isn't exact as a number");
+    }
+
+    out.setNumber(d);
+}
+
+inline void returnValue(JSContext* cx,
+                        const std::string& v,
+                        JS::MutableHandleValue out) {
+    // UTF-8 in, so not JS_NewStringCopyN, which would take
+    // the bytes as Latin1
+    size_t length;
+    char16_t* chars =
+        JS::UTF8CharsToNewTwoByteCharsZ(
+            cx, JS::UTF8Chars(v.data(), v.size()), &length)
+            .get();
+    if (!chars)
+        throwCurrentJSException(cx, "failed to decode string");
+
+    JSString* str = JS_NewUCString(cx, chars, length);
+    if (!str) {
+        js_free(chars);
+        throwCurrentJSException(cx, "failed to allocate string");
+    }
+    out.setString(str);
+}
+
+inline void returnValue(JSContext*,
+                        const JS::Value& v,
+                        JS::MutableHandleValue out) {
+    out.set(v);
+}
+
+template <typename T, typename Tuple>
+struct TupleContains;
+
+template <typename T, typename... Ts>
+struct TupleContains<T, std::tuple<Ts...>>
+    : std::disjunction<std::is_same<T, std::decay_t<Ts>>...> {};
+
+template <typename Tuple>
+struct TupleTail;
+
+template <typename Head, typename... Tail>
+struct TupleTail<std::tuple<Head, Tail...>> {
+    using type = std::tuple<Tail...>;
+};
+
+// The parameters that come from JS: all of them, less a
+// leading JSContext*
+template <typename Traits>
+using JSParams =
+    typename std::conditional_t<takesContext<Traits>(),
+                                TupleTail<typename Traits::Params>,
+                                std::common_type<
+                                    typename Traits::Params>>::type;
+
+template <auto fn, typename Params>
+struct TypedInvoker;
+
+template <auto fn, typename... Params>
+struct TypedInvoker<fn, std::tuple<Params...>> {
+    static void call(JSContext* cx, JS::CallArgs args) {
+        invoke(cx, args, std::index_sequence_for<Params...>());
+    }
+
+    template <size_t... I>
+    static void invoke(JSContext* cx,
+                       JS::CallArgs args,
+                       std::index_sequence<I...>) {
+        using Traits = FunctionTraits<decltype(fn)>;
+
+        if (args.length() < sizeof...(I)) {
+            throw ArgumentCountError(
+                "expected " + std::to_string(sizeof...(I)) +
+                " argument(s), got " +
+                std::to_string(args.length()));
+        }
+
+        Converters<0, Params...> converters(cx, args);
+
+        auto call = [&] {
+            if constexpr (takesContext<Traits>()) {
+                return fn(cx,
+                          convertedValue(
+                              cx, converterAt<I>(converters))...);
+            } else {
+                return fn(convertedValue(
+                    cx, converterAt<I>(converters))...);
+            }
+        };
+
+        if constexpr (std::is_void<
+                          typename Traits::Return>::value) {
+            call();
+            args.rval().setUndefined();
+        } else {
+            returnValue(cx, call(), args.rval());
+        }
+    }
+};
+
+// The JSNative.  Exceptions go through the same lippincott
+// as everything else.
+template <auto fn>
+bool wrapTypedFunction(JSContext* cx,
+                       unsigned argc,
+                       JS::Value* vp) {
+    using Traits = FunctionTraits<decltype(fn)>;
+
+    static_assert(!takesContext<Traits>() ||
+                      !TupleContains<std::string_view,
+                                     JSParams<Traits>>::value,
+                  "a function taking JSContext* can't take "
+                  "std::string_view; take std::string instead");
+
+    try {
+        JS::CallArgs args = JS::CallArgsFromVp(argc, vp);
+        TypedInvoker<fn, JSParams<Traits>>::call(cx, args);
+        return true;
+    } catch (...) {
+        cppToJSException(cx);
+        return false;
+    }
+}
+
+// A double to int64_t, truncating, for values that fit.
+// The cast alone is undefined for NaN and anything out of
+// range.
+inline int64_t truncateToInt64(double d) {
+    if (!(d >= -9223372036854775808.0 &&
+          d < 9223372036854775808.0))
+        throw std::range_error("result out of range");
+
+    return static_cast<int64_t>(d);
+}
+
+// The example from the top, and the hand written native it
+// replaces.  Both are handed "12345" and 2.5, as a string
+// and a double, so the typed version never leaves its fast
+// paths.
+struct Parse {
+    static int64_t scaled(std::string_view digits,
+                          double scale) {
+        return truncateToInt64(parseInt64(digits) * scale);
+    }
+};
+
+struct ParseScaledByHand {
+    static const char* name() {
+        return "parseScaledByHand";
+    }
+
+    static void call(JSContext* cx, JS::CallArgs args) {
+        if (args.length() < 2)
+            throw std::runtime_error(
+                "parseScaled takes two arguments");
+
+        JS::RootedString str(cx, JS::ToString(cx, args.get(0)));
+        if (!str)
+            throwCurrentJSException(cx, "expected a string");
+        JSAutoByteString digits(cx, str);
+
+        double scale;
+        if (!JS::ToNumber(cx, args.get(1), &scale))
+            throwCurrentJSException(cx, "expected a number");
+
+        args.rval().setNumber(static_cast<double>(
+            truncateToInt64(std::atoll(digits.ptr()) * scale)));
+    }
+};
+
+void benchmarkTypedFunctions(ImplScope& scope) {
+    using namespace std::chrono;
+
+    JSContext* cx = scope.getContext();
+    JSAutoRequest ar(cx);
+    JSAutoCompartment ac(cx, scope.getGlobal());
+
+    static const JSFunctionSpec functions[] = {
+        JS_FN("parseScaled",
+              wrapTypedFunction<&Parse::scaled>,
+              typedArity<&Parse::scaled>,
+              0),
+        JS_FN("parseScaledByHand",
+              wrapFunction<ParseScaledByHand>,
+              2,
+              0),
+        JS_FS_END,
+    };
+
+    JS::RootedObject global(cx, scope.getGlobal());
+    if (!JS_DefineFunctions(cx, global, functions))
+        throwCurrentJSException(cx, "failed to define functions");
+
+    for (auto fn : {"parseScaledByHand", "parseScaled"}) {
+        auto script =
+            std::string("for (var i = 0; i < 1000000; i++) ") +
+            fn + "('12345', 2.5);";
+
+        auto start = steady_clock::now();
+        scope.exec(script);
+        std::cout << fn << ": "
+                  << duration_cast<milliseconds>(
+                         steady_clock::now() - start)
+                         .count()
+                  << " ms per million calls\n";
+    }
+}
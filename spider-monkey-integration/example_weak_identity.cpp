@@ -0,0 +1,213 @@
+// Natives that hand C++ objects to scripts make a wrapper
+// each time.  Give a script the same document field twice
+// and it gets two BSONMyTypes for the same 8 bytes:
+//
+//     var a = doc.count, b = doc.count;
+//     a === b  // false
+//
+// which is surprising, and for anything handed over in a
+// loop it's an allocation (and, later, a finalization) per
+// pass for an object the script may already have.
+//
+// So a type can opt in, through the weakIdentity policy
+// flag on BaseInfo, to keeping at most one wrapper per
+// native object per context.  The scope keeps a map from
+// native pointer to wrapper, and make() returns the
+// wrapper that's already there if there is one.
+//
+// The map mustn't keep wrappers alive: that would pin every
+// object ever handed over for the life of the context.  So
+// entries are weak.  The engine calls us back at the start
+// of sweeping, once it knows what's dead, and
+// JS_UpdateWeakPointerAfterGC tells us, entry by entry,
+// whether the wrapper survived (and where it moved to if
+// it's been compacted).  Dead entries are dropped there,
+// before any finalizer runs, so the finalizer can release
+// the native without the map ever holding a pointer to a
+// freed one.
+//
+// Two things keep this sound:
+//
+// - The key has to stay valid exactly as long as the
+//   wrapper does.  BSONMyType keys on its value pointer,
+//   which lies inside a buffer the wrapper holds a
+//   reference on, so no other live native can have that
+//   address.
+//
+// - A wrapper found in the map may be one an incremental GC
+//   hasn't marked yet.  Handing it back to a script without
+//   telling the GC would let it be swept while in use, so
+//   lookups go through JS::ExposeObjectToActiveJS.
+//
+// Structured clones still make fresh objects, as clones
+// should.  See example_structured_clone.cpp.
+
+template <typename T>
+class IdentityMap {
+public:
+    static_assert(T::weakIdentity,
+                  "IdentityMap requires a weakIdentity policy");
+
+    explicit IdentityMap(JSContext* cx)
+        : _runtime(JS_GetRuntime(cx)) {
+        if (!JS_AddWeakPointerCallback(
+                _runtime, sweep, this)) {
+            throw std::runtime_error(
+                "failed to register identity map callback");
+        }
+    }
+
+    ~IdentityMap() {
+        JS_RemoveWeakPointerCallback(_runtime, sweep);
+    }
+
+    IdentityMap(const IdentityMap&) = delete;
+    IdentityMap& operator=(const IdentityMap&) = delete;
+
+    // Hand back the live wrapper for native, or make one
+    // with T::makeUncached(cx, args..., out) and remember it
+    template <typename... Args>
+    void get(JSContext* cx,
+             const void* native,
+             JS::MutableHandleObject out,
+             Args&&... args) {
+        auto it = _wrappers.find(native);
+
+        if (it != _wrappers.end()) {
+            JS::ExposeObjectToActiveJS(it->second);
+            out.set(it->second);
+            _hits++;
+            return;
+        }
+
+        T::makeUncached(cx, std::forward<Args>(args)..., out);
+
+        _wrappers.emplace(native, out.get());
+        _misses++;
+    }
+
+    size_t size() const {
+        return _wrappers.size();
+    }
+
+    uint64_t hits() const {
+        return _hits;
+    }
+
+    uint64_t misses() const {
+        return _misses;
+    }
+
+private:
+    static void sweep(JSRuntime*, void* data) {
+        auto map = static_cast<IdentityMap*>(data);
+
+        for (auto it = map->_wrappers.begin();
+             it != map->_wrappers.end();) {
+            JS_UpdateWeakPointerAfterGC(&it->second);
+
+            if (it->second) {
+                ++it;
+            } else {
+                it = map->_wrappers.erase(it);
+            }
+        }
+    }
+
+    JSRuntime* _runtime;
+
+    // Node based, so each Heap stays at one address for as
+    // long as the engine may be tracking it
+    std::unordered_map<const void*, JS::Heap<JSObject*>>
+        _wrappers;
+
+    uint64_t _hits = 0;
+    uint64_t _misses = 0;
+};
+
+// BSONMyTypeInfo::make now goes through the map, so every
+// native that turns a field into a MyType (field access,
+// batch marshalling, ...) hands back the same object for
+// the same field while a script still holds it.
+void BSONMyTypeInfo::make(JSContext* cx,
+                          SharedBuffer* buffer,
+                          const char* value,
+                          JS::MutableHandleValue out) {
+    JS::RootedObject obj(cx);
+    ImplScope::fromContext(cx)
+        .getIdentityMap<BSONMyTypeInfo>()
+        .get(cx, value, &obj, buffer, value);
+
+    out.setObject(*obj);
+}
+
+// The same 10K fields passed into a script a million times,
+// with and without the map.  Without it, that's a million
+// wrappers for the GC to find and finalize.
+void benchmarkIdentity(ImplScope& scope) {
+    using namespace std::chrono;
+
+    const size_t kFields = 10 * 1000;
+    const size_t kCalls = 1000 * 1000;
+
+    JSContext* cx = scope.getContext();
+    JSRuntime* rt = JS_GetRuntime(cx);
+    JSAutoRequest ar(cx);
+    JSAutoCompartment ac(cx, scope.getGlobal());
+
+    auto buffer = SharedBuffer::allocate(kFields * 8);
+    for (size_t i = 0; i < kFields; i++) {
+        uint64_t raw = htole64(i);
+        std::memcpy(buffer->data() + i * 8, &raw, 8);
+    }
+
+    scope.exec("var total = 0;"
+               "function take(v) { total += v.toNumber(); }");
+
+    JS::RootedObject global(cx, scope.getGlobal());
+    auto& identities = scope.getIdentityMap<BSONMyTypeInfo>();
+
+    auto time = [&](const char* label, auto&& make) {
+        JS::RootedValue field(cx);
+        JS::RootedValue rval(cx);
+
+        auto gcBefore = JS_GetGCParameter(rt, JSGC_NUMBER);
+        auto hitsBefore = identities.hits();
+        auto start = steady_clock::now();
+
+        for (size_t i = 0; i < kCalls; i++) {
+            make(buffer->data() + (i % kFields) * 8, &field);
+
+            JS::AutoValueArray<1> args(cx);
+            args[0].set(field);
+            if (!JS_CallFunctionName(
+                    cx, global, "take", args, &rval))
+                throwCurrentJSException(cx, "take failed");
+        }
+
+        auto elapsed = steady_clock::now() - start;
+
+        std::cout
+            << label << ": "
+            << duration_cast<milliseconds>(elapsed).count()
+            << " ms, "
+            << JS_GetGCParameter(rt, JSGC_NUMBER) - gcBefore
+            << " GCs, " << identities.hits() - hitsBefore
+            << " reused\n";
+    };
+
+    time("fresh wrappers", [&](const char* value,
+                               JS::MutableHandleValue out) {
+        JS::RootedObject obj(cx);
+        BSONMyTypeInfo::makeUncached(cx, buffer, value, &obj);
+        out.setObject(*obj);
+    });
+
+    time("identity map  ", [&](const char* value,
+                               JS::MutableHandleValue out) {
+        BSONMyTypeInfo::make(cx, buffer, value, out);
+    });
+
+    // The wrappers hold their own references
+    buffer->release();
+}